@@ -3,20 +3,30 @@
 #include <llvm/Analysis/Verifier.h>
 #include <llvm/Analysis/Passes.h>
 #include <llvm/Transforms/Scalar.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/Support/Dwarf.h>
+#include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <algorithm>
 #include <iostream>
+#include <sstream>
 
 #include "ast.h"
+#include "library.h"
 
 using namespace std;
 using namespace llvm;
 
-// Error handling
-static Value *ValueError(const char *error) {
-  cerr << error << endl;
+thread_local ostream *ErrorStream = &cerr;
+
+// Error handling, errors point at the offending node
+static Value *ValueError(const SourceLoc &Loc, const char *error) {
+  *ErrorStream << Loc.Line << ":" << Loc.Col << ": " << error << endl;
   return NULL;
 }
-static Function *FunctionError(const char *error) {
-  cerr << error << endl;
+static Function *FunctionError(const SourceLoc &Loc, const char *error) {
+  ValueError(Loc, error);
   return NULL;
 }
 
@@ -27,25 +37,214 @@ static AllocaInst *CreateEntryBlockAlloca(Kaleidoscope &ctx,
   return B.CreateAlloca(Type::getDoubleTy(ctx.TheContext), 0, Var.c_str());
 }
 
+// the value of a variable bound in NamedValues, loaded from its slot unless
+// it's an SSA value (Kaleidoscope::DirectSSA)
+static Value *VariableValue(Kaleidoscope &ctx, Value *V, const string &Var) {
+  if (isa<AllocaInst>(V))
+    return ctx.Builder.CreateLoad(V, Var.c_str());
+  return V;
+}
+
+// bind Var to V in a stack slot, or to V itself when building SSA directly
+static void BindVariable(Kaleidoscope &ctx, const string &Var, Value *V) {
+  if (ctx.DirectSSA) {
+    ctx.NamedValues[Var] = V;
+    return;
+  }
+  AllocaInst *A = CreateEntryBlockAlloca(ctx, Var);
+  ctx.Builder.CreateStore(V, A);
+  ctx.NamedValues[Var] = A;
+}
+
+// Math builtins lowered to LLVM intrinsics instead of opaque calls into libm
+// so the optimizer can constant-fold and hoist them
+static Function *MathIntrinsic(Kaleidoscope &ctx, const string &Name,
+                               unsigned NArgs) {
+  static const struct {
+    const char *name;
+    Intrinsic::ID id;
+    unsigned nargs;
+  } builtins[] = { { "sqrt", Intrinsic::sqrt, 1 },
+                   { "sin", Intrinsic::sin, 1 },
+                   { "cos", Intrinsic::cos, 1 },
+                   { "exp", Intrinsic::exp, 1 },
+                   { "log", Intrinsic::log, 1 },
+                   { "pow", Intrinsic::pow, 2 },
+                   { "fabs", Intrinsic::fabs, 1 },
+                   { "floor", Intrinsic::floor, 1 },
+                   { "fma", Intrinsic::fma, 3 } };
+  for (unsigned i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i) {
+    if (Name == builtins[i].name && NArgs == builtins[i].nargs) {
+      Type *DblTy = Type::getDoubleTy(ctx.TheContext);
+      return Intrinsic::getDeclaration(ctx.TheModule, builtins[i].id, DblTy);
+    }
+  }
+  return NULL;
+}
+
+// Declare (once per module) a runtime function from library.cc taking and
+// returning doubles
+static Function *RuntimeFunction(Kaleidoscope &ctx, const char *Name,
+                                 unsigned NArgs) {
+  Type *DblTy = Type::getDoubleTy(ctx.TheContext);
+  vector<Type *> DblArgs(NArgs, DblTy);
+  FunctionType *FT = FunctionType::get(DblTy, DblArgs, false);
+  return cast<Function>(ctx.TheModule->getOrInsertFunction(Name, FT));
+}
+
+// Array builtins: array(n), load(a, i), store(a, i, v), len(a)
+static bool IsArrayBuiltin(const string &Name, unsigned NArgs) {
+  return (Name == "array" && NArgs == 1) || (Name == "load" && NArgs == 2) ||
+         (Name == "store" && NArgs == 3) || (Name == "len" && NArgs == 1);
+}
+
+// An array is a double holding the bits of its base pointer (library.cc),
+// turn it back into a pointer to the i-th element
+static Value *ArrayElement(Kaleidoscope &ctx, Value *Array, Value *Index) {
+  Type *I64Ty = Type::getInt64Ty(ctx.TheContext);
+  Value *Base = ctx.Builder.CreateIntToPtr(
+      ctx.Builder.CreateBitCast(Array, I64Ty, "arraybits"),
+      Type::getDoublePtrTy(ctx.TheContext), "arrayptr");
+  Value *Idx = ctx.Builder.CreateFPToSI(Index, I64Ty, "idx");
+  return ctx.Builder.CreateGEP(Base, Idx, "elemptr");
+}
+
+// loads/stores are emitted inline so the optimizer sees plain memory ops
+// (GVN and LICM, there's no loop vectorizer: indices come from double loop
+// variables and loops exit on fcmp, which SCEV can't count)
+static Value *ArrayCodegen(Kaleidoscope &ctx, const string &Name,
+                           vector<Value *> &ArgsV) {
+  if (Name == "array")
+    return ctx.Builder.CreateCall(RuntimeFunction(ctx, "arrayalloc", 1),
+                                  ArgsV[0], "array");
+  if (Name == "len")
+    return ctx.Builder.CreateCall(RuntimeFunction(ctx, "arraylen", 1),
+                                  ArgsV[0], "len");
+  Value *Ptr = ArrayElement(ctx, ArgsV[0], ArgsV[1]);
+  if (Name == "load")
+    return ctx.Builder.CreateLoad(Ptr, "elem");
+  // store evaluates to the stored value
+  ctx.Builder.CreateStore(ArgsV[2], Ptr);
+  return ArgsV[2];
+}
+
+// Interprocedural purity: a function that only touches its own stack slots
+// and calls nothing but pure functions (or itself) is readnone, readonly if
+// it also reads arrays. Calls to putchard & co. (no attributes) or any store
+// to memory keep it impure, execution counters included (instrumented
+// calls mustn't be merged or hoisted, their counts would be off). Callees are
+// inferred before their callers since they must be defined first, which
+// makes the per-function scan sufficient
+static void InferPurity(Function *F) {
+  bool ReadsMemory = false;
+  for (Function::iterator BB = F->begin(); BB != F->end(); ++BB) {
+    for (BasicBlock::iterator I = BB->begin(); I != BB->end(); ++I) {
+      if (LoadInst *L = dyn_cast<LoadInst>(I)) {
+        if (!isa<AllocaInst>(L->getPointerOperand()))
+          ReadsMemory = true;
+      } else if (StoreInst *S = dyn_cast<StoreInst>(I)) {
+        if (!isa<AllocaInst>(S->getPointerOperand()))
+          return;
+      } else if (CallInst *C = dyn_cast<CallInst>(I)) {
+        Function *Callee = C->getCalledFunction();
+        if (Callee == F || (Callee && Callee->doesNotAccessMemory()))
+          continue;
+        if (Callee == NULL || !Callee->onlyReadsMemory())
+          return;
+        ReadsMemory = true;
+      }
+    }
+  }
+  if (ReadsMemory)
+    F->setOnlyReadsMemory();
+  else
+    F->setDoesNotAccessMemory();
+  F->setDoesNotThrow();
+}
+
+// counters are emitted for profiles (Instrument) and to drive tiering
+static bool Counting(Kaleidoscope &ctx) {
+  return ctx.Instrument || ctx.QuickFPM != NULL;
+}
+
+// Bump an execution counter (see Counting) of the function being emitted.
+// Plain load/add/store, counts from concurrent calls are approximate
+static uint64_t *EmitCounter(Kaleidoscope &ctx, const char *Kind,
+                             const SourceLoc &Loc) {
+  if (!Counting(ctx))
+    return NULL;
+  Function *F = ctx.Builder.GetInsertBlock()->getParent();
+  uint64_t *Slot = NewCounter(F->getName().str(), Kind, Loc.Line, Loc.Col);
+  Type *I64Ty = Type::getInt64Ty(ctx.TheContext);
+  Value *Ptr = ctx.Builder.CreateIntToPtr(
+      ConstantInt::get(I64Ty, (uintptr_t)Slot), PointerType::getUnqual(I64Ty));
+  LoadInst *N = ctx.Builder.CreateLoad(Ptr, "count");
+  StoreInst *S = ctx.Builder.CreateStore(
+      ctx.Builder.CreateAdd(N, ConstantInt::get(I64Ty, 1)), Ptr);
+  MDNode *Tag = MDNode::get(ctx.TheContext, ArrayRef<Value *>());
+  N->setMetadata("kaleidoscope.counter", Tag);
+  S->setMetadata("kaleidoscope.counter", Tag);
+  return Slot;
+}
+
+static unsigned CountInstructions(Function *F) {
+  unsigned n = 0;
+  for (Function::iterator BB = F->begin(); BB != F->end(); ++BB)
+    n += BB->size();
+  return n;
+}
+
+// Propagate the callee's purity to the call site for GVN/LICM's benefit
+static CallInst *MarkCall(CallInst *Call, Function *F) {
+  if (F->doesNotAccessMemory())
+    Call->setDoesNotAccessMemory();
+  else if (F->onlyReadsMemory())
+    Call->setOnlyReadsMemory();
+  if (F->doesNotThrow())
+    Call->setDoesNotThrow();
+  return Call;
+}
+
 // Op-Token => <precedence, associativity (-1 left, 1 right)> (llparser.cc)
 extern map<Token, pair<int, int> > OperatorPrecedenceAssoc;
+extern map<string, map<Token, pair<int, int> > > ScopedOperators;
+
+// function level optimizer for M, the full pipeline or the tier-0 one
+static FunctionPassManager *NewPipeline(Kaleidoscope &ctx, Module *M,
+                                        bool Quick) {
+  FunctionPassManager *FPM = new FunctionPassManager(M);
+  FPM->add(new DataLayout(*ctx.TheEE->getDataLayout()));
+  if (Quick) {
+    if (!ctx.DirectSSA) // nothing to promote otherwise
+      FPM->add(createPromoteMemoryToRegisterPass());
+    FPM->add(createCFGSimplificationPass());
+  } else {
+    FPM->add(createBasicAliasAnalysisPass());
+    if (!ctx.DirectSSA)
+      FPM->add(createPromoteMemoryToRegisterPass());
+    FPM->add(createInstructionCombiningPass());
+    FPM->add(createReassociatePass());
+    FPM->add(createLICMPass()); // hoists pure calls out of loops
+    FPM->add(createGVNPass());
+    FPM->add(createCFGSimplificationPass());
+  }
+  FPM->doInitialization();
+  return FPM;
+}
 
 Kaleidoscope::Kaleidoscope()
-    : TheContext(getGlobalContext()), Builder(TheContext) {
+    : TheContext(getGlobalContext()), Builder(TheContext), Stats(NULL),
+      DBuilder(NULL), DIScope(NULL), Instrument(false), QuickFPM(NULL),
+      HotThreshold(0), BatchSize(1), BatchWindow(0), Batching(false),
+      Code(new CodeSizeListener()), DirectSSA(false), Anonymous(0) {
   InitializeNativeTarget();
   TheModule = new Module("Kaleidoscope", TheContext);
+  Modules.insert(TheModule);
   // Create the JIT execution engine
   TheEE = EngineBuilder(TheModule).create();
+  TheEE->RegisterJITEventListener(Code);
   // setup a function level optimizer
-  TheFPM = new FunctionPassManager(TheModule);
-  TheFPM->add(new DataLayout(*TheEE->getDataLayout()));
-  TheFPM->add(createBasicAliasAnalysisPass());
-  TheFPM->add(createPromoteMemoryToRegisterPass());
-  TheFPM->add(createInstructionCombiningPass());
-  TheFPM->add(createReassociatePass());
-  TheFPM->add(createGVNPass());
-  TheFPM->add(createCFGSimplificationPass());
-  TheFPM->doInitialization();
+  TheFPM = NewPipeline(*this, TheModule, false);
 
   // Initialize operator precedence
   OperatorPrecedenceAssoc[Token(Token::tokLT, "<")] = make_pair(10, -1);
@@ -55,20 +254,679 @@ Kaleidoscope::Kaleidoscope()
   OperatorPrecedenceAssoc[Token(Token::tokDivide, "/")] = make_pair(40, -1);
 }
 
+// Every top-level item gets a module of its own so module-level work (and
+// the JIT's) doesn't grow with the session. Functions of other modules are
+// reached through declarations mapped to their code (see Declare)
+static bool HasDefinitions(Module *M) { // helpers like parfor bodies aside
+  for (Module::iterator F = M->begin(); F != M->end(); ++F)
+    if (!F->isDeclaration() && !F->hasLocalLinkage())
+      return true;
+  return false;
+}
+
+// modules only unique names within themselves, and there's one per item
+string Kaleidoscope::AnonymousName(const char *Prefix) {
+  ostringstream Name;
+  Name << Prefix << ++Anonymous;
+  return Name.str();
+}
+
+void Kaleidoscope::StartModule(bool Fresh) {
+  if (!Fresh && !HasDefinitions(TheModule)) // reuse it, declarations are ok
+    return;
+  Module *Prev = TheModule;
+  TheModule = new Module("Kaleidoscope", TheContext);
+  Modules.insert(TheModule);
+  TheEE->addModule(TheModule);
+  delete TheFPM;
+  TheFPM = NewPipeline(*this, TheModule, false);
+  if (QuickFPM) {
+    delete QuickFPM;
+    QuickFPM = NewPipeline(*this, TheModule, true);
+  }
+  if (DBuilder) {
+    string Filename = DIUnit.getFilename().str();
+    delete DBuilder;
+    EnableDebugInfo(Filename);
+  }
+  ReleaseModule(Prev);
+}
+
 Kaleidoscope::fptr Kaleidoscope::Parse(Lexer &lexer) {
+  if (QuickFPM)
+    TierUp();
+  StartModule();
   // JIT the function returning a func ptr
   pair<bool, Function *> R = ParseNext(lexer, *this);
   if (R.first && R.second) {
     //R.second->dump();
-    return (double(*)()) TheEE->getPointerToFunction(R.second);
+    if (Stats)
+      Stats->Switch(CompileStats::phJIT);
+    fptr FP = (double(*)()) TheEE->getPointerToFunction(R.second);
+    if (Stats)
+      Stats->Switch(CompileStats::phIdle);
+    return FP;
+  }
+  return NULL;
+}
+
+// Streams of top-level expressions pay verification, optimization and JIT
+// overhead per expression. Here consecutive expressions, up to BatchSize or
+// as many as parsed within BatchWindow seconds (checked between items, the
+// lexer may block), are inlined into one driver that's optimized and JIT'd
+// once and stores their values in order. A def or extern closes the batch so
+// it only applies to the expressions after it. Results gets the values of
+// the batch (none if there were only definitions), false on errors
+bool Kaleidoscope::ParseBatch(Lexer &lexer, vector<double> &Results) {
+  vector<Function *> Exprs;
+  bool Ok = true;
+  chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+  Batching = true;
+  while (lexer.Current().lex_comp != Token::tokEOF) {
+    Token::lexic_component c = lexer.Current().lex_comp;
+    if (!Exprs.empty() && (c == Token::tokDef || c == Token::tokExtern))
+      break;
+    if (QuickFPM && Exprs.empty())
+      TierUp();
+    if (Exprs.empty()) // the batch shares a module to be inlined together
+      StartModule();
+    pair<bool, Function *> R = ParseNext(lexer, *this);
+    Ok = Ok && R.first;
+    if (R.second)
+      Exprs.push_back(R.second);
+    double Elapsed =
+        chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    if (Exprs.size() >= BatchSize ||
+        (BatchWindow > 0 && Elapsed >= BatchWindow))
+      break;
+  }
+  Batching = false;
+  Results.clear();
+  if (Exprs.empty())
+    return Ok;
+
+  // void __batch(double *results)
+  Type *DblTy = Type::getDoubleTy(TheContext);
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(TheContext),
+                                       PointerType::getUnqual(DblTy), false);
+  Function *D = Function::Create(FT, Function::ExternalLinkage,
+                                 AnonymousName("__batch"), TheModule);
+  Builder.SetInsertPoint(BasicBlock::Create(TheContext, "entry", D));
+  Builder.SetCurrentDebugLocation(DebugLoc());
+  vector<CallInst *> Calls;
+  for (unsigned i = 0; i < Exprs.size(); i++) {
+    Calls.push_back(Builder.CreateCall(Exprs[i], "expr"));
+    Value *Slot = Builder.CreateConstGEP1_32(D->arg_begin(), i);
+    Builder.CreateStore(Calls[i], Slot);
+  }
+  Builder.CreateRetVoid();
+  for (unsigned i = 0; i < Exprs.size(); i++) {
+    InlineFunctionInfo IFI;
+    InlineFunction(Calls[i], IFI);
+    Exprs[i]->eraseFromParent();
+  }
+  verifyFunction(*D);
+  if (DBuilder)
+    DBuilder->finalize();
+  if (Stats)
+    Stats->Switch(CompileStats::phOptimize);
+  TheFPM->run(*D);
+  if (Stats)
+    Stats->Switch(CompileStats::phJIT);
+  void (*FP)(double *) = (void (*)(double *))TheEE->getPointerToFunction(D);
+  if (Stats)
+    Stats->Switch(CompileStats::phIdle);
+
+  Results.resize(Exprs.size());
+  FP(&Results[0]);
+  Release(D); // batches run once
+  return Ok;
+}
+
+// Emit line tables for everything compiled from now on, a compile unit per
+// module finalized before the JIT sees its code. Locations reach the JIT
+// through the DebugLocs on the generated code and only JIT event listeners
+// see them (JITDumpListener, for perf). The legacy JIT emits no DWARF, so
+// debuggers get nothing (that takes MCJIT and its GDB JIT registration)
+void Kaleidoscope::EnableDebugInfo(const string &Filename) {
+  DBuilder = new DIBuilder(*TheModule);
+  DBuilder->createCompileUnit(dwarf::DW_LANG_C, Filename, ".", "Kaleidoscope",
+                              false, "", 0);
+  DIUnit = DBuilder->createFile(Filename, ".");
+}
+
+// attach Loc to the instructions emitted next (none if unknown)
+void Kaleidoscope::EmitLocation(const SourceLoc &Loc) {
+  if (DBuilder == NULL)
+    return;
+  if (Loc.Line == 0 || DIScope == NULL)
+    Builder.SetCurrentDebugLocation(DebugLoc());
+  else
+    Builder.SetCurrentDebugLocation(DebugLoc::get(Loc.Line, Loc.Col, DIScope));
+}
+
+// debug info subprogram for F, every function is double(double, ...)
+static MDNode *DebugFunction(Kaleidoscope &ctx, Function *F, unsigned Line) {
+  DIType DblTy =
+      ctx.DBuilder->createBasicType("double", 64, 64, dwarf::DW_ATE_float);
+  SmallVector<Value *, 8> EltTys;
+  for (unsigned i = 0; i <= F->arg_size(); i++) // return type + args
+    EltTys.push_back(DblTy);
+  DIType FT = ctx.DBuilder->createSubroutineType(
+      ctx.DIUnit, ctx.DBuilder->getOrCreateArray(EltTys));
+  return ctx.DBuilder->createFunction(ctx.DIUnit, F->getName(), StringRef(),
+                                      ctx.DIUnit, Line, FT, false, true, Line,
+                                      DIDescriptor::FlagPrototyped, false, F);
+}
+
+// ----------------------------------------------------------------------
+// Tiered compilation: definitions start with a quick pipeline and once their
+// entry counter reaches HotThreshold they're recompiled with the full one,
+// with small callees inlined and branches weighted by the observed counts.
+// LLVMContext and the JIT aren't thread-safe and relinking patches the old
+// code's entry, so hot functions are promoted here, between top-level items
+// while no JIT'd code runs, instead of on a background thread.
+void Kaleidoscope::EnableTiering(unsigned Threshold) {
+  HotThreshold = Threshold;
+  QuickFPM = NewPipeline(*this, TheModule, true); // counters on (Counting)
+}
+
+// Arguments and loop variables can't be assigned to, so codegen can use the
+// values themselves (phis for loops) instead of stack slots mem2reg has to
+// promote again for every function. Pipelines are rebuilt without it
+void Kaleidoscope::EnableDirectSSA() {
+  DirectSSA = true;
+  delete TheFPM;
+  TheFPM = NewPipeline(*this, TheModule, false);
+  if (QuickFPM) {
+    delete QuickFPM;
+    QuickFPM = NewPipeline(*this, TheModule, true);
+  }
+}
+
+// callees up to this many instructions get inlined into hot functions
+static const unsigned InlineLimit = 64;
+
+// what G, used by code of another module, stands for in M
+static Function *Resolve(Kaleidoscope &ctx, Function *G, Module *M) {
+  if (Function *Def = ctx.Lookup(G->getName().str()))
+    return ctx.Declare(Def, M);
+  // runtime, host functions and intrinsics are bound by name
+  Function *D = cast<Function>(
+      M->getOrInsertFunction(G->getName(), G->getFunctionType()));
+  D->setAttributes(G->getAttributes());
+  return D;
+}
+
+// Callees live in modules of their own and are only declared in the hot
+// function's, M. Def's body is copied there (as an internal function) to be
+// inlined. NULL if it uses functions local to its module (parfor chunks)
+static Function *CopyBody(Kaleidoscope &ctx, Function *Def, Module *M) {
+  ValueToValueMapTy VMap;
+  for (Function::iterator BB = Def->begin(); BB != Def->end(); ++BB)
+    for (BasicBlock::iterator I = BB->begin(); I != BB->end(); ++I)
+      for (unsigned i = 0; i < I->getNumOperands(); i++) {
+        Function *G = dyn_cast<Function>(I->getOperand(i)->stripPointerCasts());
+        if (G == NULL || VMap.count(G))
+          continue;
+        if (G->hasLocalLinkage())
+          return NULL;
+        VMap[G] = Resolve(ctx, G, M);
+      }
+  Function *Copy = Function::Create(Def->getFunctionType(),
+                                    Function::InternalLinkage,
+                                    Def->getName() + ".inlined", M);
+  Function::arg_iterator A = Copy->arg_begin();
+  for (Function::arg_iterator I = Def->arg_begin(); I != Def->arg_end(); ++I)
+    VMap[I] = A++;
+  SmallVector<ReturnInst *, 4> Returns;
+  CloneFunctionInto(Copy, Def, VMap, true, Returns);
+  return Copy;
+}
+
+static void InlineCallees(Kaleidoscope &ctx, Function *F) {
+  vector<pair<CallInst *, Function *> > Calls; // -> the declared callee
+  map<Function *, Function *> Bodies;          // definition -> its copy
+  for (Function::iterator BB = F->begin(); BB != F->end(); ++BB)
+    for (BasicBlock::iterator I = BB->begin(); I != BB->end(); ++I) {
+      CallInst *C = dyn_cast<CallInst>(I);
+      Function *Callee = C ? C->getCalledFunction() : NULL;
+      if (Callee == NULL || Callee == F || Callee->isIntrinsic())
+        continue;
+      Function *Def = Callee->isDeclaration()
+                          ? ctx.Lookup(Callee->getName().str())
+                          : Callee;
+      if (Def == NULL || Def == F || Def->isDeclaration() ||
+          CountInstructions(Def) > InlineLimit)
+        continue;
+      if (Def->getParent() != F->getParent()) {
+        if (Bodies.count(Def) == 0)
+          Bodies[Def] = CopyBody(ctx, Def, F->getParent());
+        if (Bodies[Def] == NULL)
+          continue;
+        C->setCalledFunction(Bodies[Def]);
+      }
+      Calls.push_back(make_pair(C, Callee));
+    }
+  for (unsigned i = 0; i < Calls.size(); i++) {
+    InlineFunctionInfo IFI;
+    if (!InlineFunction(Calls[i].first, IFI))
+      Calls[i].first->setCalledFunction(Calls[i].second);
+  }
+  map<Function *, Function *>::iterator B;
+  for (B = Bodies.begin(); B != Bodies.end(); ++B)
+    if (B->second)
+      B->second->eraseFromParent();
+}
+
+// IfExprAST tags its branch with the counter slots of both arms
+static void ApplyBranchWeights(Function *F) {
+  MDBuilder MDB(F->getContext());
+  for (Function::iterator BB = F->begin(); BB != F->end(); ++BB) {
+    Instruction *Br = BB->getTerminator();
+    MDNode *Slots = Br ? Br->getMetadata("kaleidoscope.prof") : NULL;
+    if (Slots == NULL)
+      continue;
+    uint64_t Then = *(uint64_t *)cast<ConstantInt>(Slots->getOperand(0))
+                         ->getZExtValue();
+    uint64_t Else = *(uint64_t *)cast<ConstantInt>(Slots->getOperand(1))
+                         ->getZExtValue();
+    while (Then > 0x7fffffff || Else > 0x7fffffff) { // weights are 32 bit
+      Then >>= 1;
+      Else >>= 1;
+    }
+    Br->setMetadata(LLVMContext::MD_prof,
+                    MDB.createBranchWeights(Then + 1, Else + 1));
+  }
+}
+
+// Counter updates (EmitCounter) have done their job once F is promoted,
+// its execution counts stop growing from then on
+static void StripCounters(Function *F) {
+  vector<StoreInst *> Updates;
+  for (Function::iterator BB = F->begin(); BB != F->end(); ++BB)
+    for (BasicBlock::iterator I = BB->begin(); I != BB->end(); ++I)
+      if (StoreInst *S = dyn_cast<StoreInst>(I))
+        if (S->getMetadata("kaleidoscope.counter"))
+          Updates.push_back(S);
+  for (unsigned i = 0; i < Updates.size(); i++) {
+    Instruction *Add = cast<Instruction>(Updates[i]->getValueOperand());
+    Instruction *Load = cast<Instruction>(Add->getOperand(0));
+    Updates[i]->eraseFromParent();
+    Add->eraseFromParent();
+    Load->eraseFromParent();
+  }
+}
+
+void Kaleidoscope::TierUp() {
+  map<Function *, uint64_t *>::iterator T = Tier0.begin();
+  while (T != Tier0.end()) {
+    if (*T->second < HotThreshold) {
+      ++T;
+      continue;
+    }
+    Function *F = T->first;
+    ValueToValueMapTy VMap; // keep the tier-0 body in case a callee changes
+    Tier1[F] = make_pair(T->second, CloneFunction(F, VMap, false));
+    Tier0.erase(T++);
+    InlineCallees(*this, F);
+    ApplyBranchWeights(F);
+    if (!Instrument) // only there to tier up, the tier-0 clone keeps them
+      StripCounters(F);
+    FunctionPassManager *FPM = NewPipeline(*this, F->getParent(), false);
+    FPM->run(*F);
+    delete FPM;
+    TheEE->recompileAndRelinkFunction(F);
+  }
+}
+
+// ----------------------------------------------------------------------
+// Redefinition: the new definition is compiled in a module of its own like
+// any other and the old function's body becomes a tail call to it, relinked
+// by the JIT. Callers keep calling the old function (whose entry the JIT
+// patches with a jump to its new code) so none of them is recompiled unless
+// the new definition adds side effects (RecompileCallers), and calls already
+// running finish on the old code, which is never freed. Every earlier version
+// is retargeted too, so callers reach the current code in a single hop
+// however many times the function was reloaded. Old versions go with their
+// scope (DropScope).
+
+// replace To's body with From's, leaving From empty
+static void MoveBody(Function *From, Function *To) {
+  To->deleteBody();
+  To->getBasicBlockList().splice(To->end(), From->getBasicBlockList());
+  Function::arg_iterator A = From->arg_begin(), B = To->arg_begin();
+  for (; A != From->arg_end(); ++A, ++B) {
+    A->replaceAllUsesWith(B);
+    B->takeName(A);
   }
+}
+
+// by name, callees of other modules are called through their declarations
+static bool CallsFunction(Function *F, Function *Callee) {
+  for (Function::iterator BB = F->begin(); BB != F->end(); ++BB)
+    for (BasicBlock::iterator I = BB->begin(); I != BB->end(); ++I)
+      if (CallInst *C = dyn_cast<CallInst>(I))
+        if (C->getCalledFunction() &&
+            C->getCalledFunction()->getName() == Callee->getName())
+          return true;
+  return false;
+}
+
+// where declarations of F in other modules point to, a lazy stub if F isn't
+// compiled yet (and the JIT compiles lazily). Without stubs F is compiled
+// right away, unless it calls something without an address yet, then they
+// stay unbound until it has one (see Unresolved)
+static void *Address(Kaleidoscope &ctx, Function *F) {
+  if (ctx.TheEE->isCompilingLazily())
+    return ctx.TheEE->getPointerToFunctionOrStub(F);
+  if (ctx.Unresolved(F))
+    return NULL;
+  return ctx.TheEE->getPointerToFunction(F);
+}
+
+// The JIT aborts the whole process on a call it can't resolve, e.g. to an
+// extern used as a forward declaration and never defined. Declarations are
+// fine if they name a host function or a definition that's fine in turn,
+// imports of those left unbound by Address are bound here. Without lazy
+// stubs, definitions calling each other across modules can't be compiled
+static Function *Unresolved(Kaleidoscope &ctx, Function *F,
+                            set<Function *> &Seen) {
+  bool Lazy = ctx.TheEE->isCompilingLazily();
+  if (!Seen.insert(F).second) // a cycle, fine if stubs break it
+    return Lazy ? NULL : F;
+  if (F->isIntrinsic())
+    return NULL;
+  if (F->isDeclaration()) {
+    StringRef Name = F->getName();
+    if (Name.endswith(".next")) // forwarders call the newest version
+      Name = Name.substr(0, Name.size() - 5);
+    Function *Def = ctx.Lookup(Name.str());
+    bool Bound = ctx.TheEE->getPointerToGlobalIfAvailable(F) != NULL;
+    if (Def == NULL || Def->isDeclaration())
+      return Bound || sys::DynamicLibrary::SearchForAddressOfSymbol(Name.str())
+                 ? NULL
+                 : F;
+    if (Function *U = Unresolved(ctx, Def, Seen))
+      return U;
+    if (!Bound)
+      ctx.TheEE->updateGlobalMapping(F, Address(ctx, Def));
+    return NULL;
+  }
+  if (!Lazy && ctx.TheEE->getPointerToGlobalIfAvailable(F))
+    return NULL; // compiled, so were its callees
+  // calls, and functions passed around (parallel for bodies)
+  for (Function::iterator BB = F->begin(); BB != F->end(); ++BB)
+    for (BasicBlock::iterator I = BB->begin(); I != BB->end(); ++I)
+      for (User::op_iterator O = I->op_begin(); O != I->op_end(); ++O)
+        if (Function *G = dyn_cast<Function>(*O))
+          if (Function *U = Unresolved(ctx, G, Seen))
+            return U;
   return NULL;
 }
 
+Function *Kaleidoscope::Unresolved(Function *F) {
+  set<Function *> Seen;
+  return ::Unresolved(*this, F, Seen);
+}
+
+// Old forwards to New from now on, and is as pure as New. Callers that
+// assumed more of Old are recompiled (RecompileCallers)
+void Kaleidoscope::Redefine(Function *Old, Function *New) {
+  Invalidate(Old);
+  Old->deleteBody();
+  Old->setAttributes(New->getAttributes());
+  Function *Next = Function::Create(New->getFunctionType(),
+                                    Function::ExternalLinkage,
+                                    Old->getName() + ".next", Old->getParent());
+  Next->setAttributes(New->getAttributes());
+  TheEE->updateGlobalMapping(Next, Address(*this, New));
+  IRBuilder<> B(BasicBlock::Create(TheContext, "entry", Old));
+  vector<Value *> Args;
+  for (Function::arg_iterator A = Old->arg_begin(); A != Old->arg_end(); ++A)
+    Args.push_back(A);
+  CallInst *Call = MarkCall(B.CreateCall(Next, Args), Next);
+  Call->setTailCall();
+  B.CreateRet(Call);
+  // only if it's been JIT'd already, otherwise its stub compiles the above
+  if (TheEE->getPointerToGlobalIfAvailable(Old))
+    TheEE->recompileAndRelinkFunction(Old);
+
+  // versions before Old forwarded to it, skip it from now on
+  string Name = Old->getName().str();
+  vector<Function *> &Earlier = Versions[Name];
+  for (unsigned i = 0; i < Earlier.size(); i++) {
+    Function *V = Earlier[i];
+    Function *VNext = V->getParent()->getFunction(Name + ".next");
+    V->setAttributes(New->getAttributes());
+    VNext->setAttributes(New->getAttributes());
+    CallInst *C = cast<CallInst>(&V->getEntryBlock().front());
+    C->setAttributes(AttributeSet());
+    MarkCall(C, VNext);
+    TheEE->updateGlobalMapping(VNext, Address(*this, New));
+    if (TheEE->getPointerToGlobalIfAvailable(V))
+      TheEE->recompileAndRelinkFunction(V);
+  }
+  Earlier.push_back(Old);
+}
+
+// Tier-1 functions may have inlined F, they go back to their tier-0 body
+// (and get promoted again, with the current F, once TierUp runs)
+void Kaleidoscope::Invalidate(Function *F) {
+  Tier0.erase(F);
+  if (Tier1.count(F)) {
+    delete Tier1[F].second;
+    Tier1.erase(F);
+  }
+  vector<Function *> Stale;
+  map<Function *, pair<uint64_t *, Function *> >::iterator T;
+  for (T = Tier1.begin(); T != Tier1.end(); ++T)
+    if (CallsFunction(T->second.second, F))
+      Stale.push_back(T->first);
+  for (unsigned i = 0; i < Stale.size(); i++) {
+    Function *C = Stale[i];
+    if (Tier1.count(C) == 0) // already restored through another callee
+      continue;
+    pair<uint64_t *, Function *> Base = Tier1[C];
+    MoveBody(Base.second, C);
+    delete Base.second;
+    Tier1.erase(C);
+    Invalidate(C); // its callers may have inlined the tier-1 C
+    Tier0[C] = Base.first;
+    TheEE->recompileAndRelinkFunction(C);
+  }
+}
+
+// ----------------------------------------------------------------------
+// Symbols maps every name to its latest definition (or extern), in whatever
+// module it lives. Other modules get declarations of it (Imports) and the
+// JIT is given their addresses up front
+
+// F is what Name means from now on. An extern of the same name gets bound
+// to it, a previous definition forwards to it. Externs are keyed by scope
+// too but keep the name they were declared with
+void Kaleidoscope::Define(const string &Name, Function *F) {
+  Function *Prev = Lookup(Name);
+  Symbols[Name] = F;
+  if (F->isDeclaration()) // an extern, resolved by name by the JIT
+    return;
+  if (Prev && !Prev->isDeclaration())
+    Redefine(Prev, F);
+  else if (Prev)
+    TheEE->updateGlobalMapping(Prev, Address(*this, F));
+  typedef multimap<string, Function *>::iterator iterator;
+  pair<iterator, iterator> R = Imports.equal_range(Name);
+  for (iterator I = R.first; I != R.second; ++I) {
+    I->second->setAttributes(F->getAttributes());
+    TheEE->updateGlobalMapping(I->second, Address(*this, F));
+  }
+}
+
+// F has side effects the definition it replaced didn't have. Its callers
+// were optimized assuming it had none (calls merged, hoisted or deleted,
+// their own purity inferred from it), so they're compiled again from their
+// AST. That redefines them in turn, and their callers if they're less pure
+// now too
+void Kaleidoscope::RecompileCallers(Function *F) {
+  vector<string> Callers;
+  map<string, pair<string, FunctionAST *> >::iterator S;
+  for (S = Sources.begin(); S != Sources.end(); ++S) {
+    Function *C = Lookup(S->first);
+    if (C && C != F && CallsFunction(C, F))
+      Callers.push_back(S->first);
+  }
+  string SavedScope = Scope;
+  CompileStats *SavedStats = Stats;
+  Stats = NULL; // the time goes to the item that redefined F
+  for (unsigned i = 0; i < Callers.size(); i++) {
+    pair<string, FunctionAST *> Src = Sources[Callers[i]];
+    Scope = Src.first;
+    StartModule(); // a module per definition as usual
+    Src.second->Codegen(*this);
+  }
+  Scope = SavedScope;
+  Stats = SavedStats;
+}
+
+Function *Kaleidoscope::Lookup(const string &Name) {
+  map<string, Function *>::iterator S = Symbols.find(Name);
+  return S == Symbols.end() ? NULL : S->second;
+}
+
+// F itself if it's in M (the current module by default), or a declaration
+// there (once)
+Function *Kaleidoscope::Declare(Function *F, Module *M) {
+  if (M == NULL)
+    M = TheModule;
+  if (F == NULL || F->getParent() == M)
+    return F;
+  if (Function *D = M->getFunction(F->getName()))
+    return D;
+  Function *D = Function::Create(F->getFunctionType(),
+                                 Function::ExternalLinkage, F->getName(), M);
+  D->setAttributes(F->getAttributes()); // for purity inference & co.
+  Imports.insert(make_pair(F->getName().str(), D));
+  if (!F->isDeclaration())
+    TheEE->updateGlobalMapping(D, Address(*this, F));
+  return D;
+}
+
+// externs name host functions, anything else is a user definition
+static bool IsUserDefined(Kaleidoscope &ctx, Function *F) {
+  if (!F->isDeclaration())
+    return true;
+  Function *Def = ctx.Lookup(F->getName().str());
+  return Def && !Def->isDeclaration();
+}
+
+// Scopes let several sessions share one engine: their definitions are
+// prefixed with Scope (never a valid identifier, e.g. "s1.") and shadow the
+// global ones, which stay compiled once for everybody. Declarations in the
+// current module may belong to another scope (StartModule reuses it)
+static Function *Find(Kaleidoscope &ctx, const string &Name) {
+  Function *F = ctx.TheModule->getFunction(Name);
+  if (F && !F->isDeclaration())
+    return F;
+  return ctx.Declare(ctx.Lookup(Name));
+}
+
+Function *Kaleidoscope::GetFunction(const string &Name) {
+  if (!Scope.empty())
+    if (Function *F = Find(*this, Scope + Name))
+      return F;
+  return Find(*this, Name);
+}
+
+// The module goes too when no other definitions are left in it, unless it's
+// the current one (which gets reused, see StartModule)
+void Kaleidoscope::Release(Function *F) {
+  Module *M = F->getParent();
+  TheEE->freeMachineCodeForFunction(F);
+  Invalidate(F);
+  F->dropAllReferences();
+  F->eraseFromParent();
+  ReleaseModule(M);
+}
+
+void Kaleidoscope::ReleaseModule(Module *M) {
+  if (M == TheModule || HasDefinitions(M))
+    return;
+  map<string, Function *>::iterator S; // externs, under any scope's key
+  for (S = Symbols.begin(); S != Symbols.end(); ++S)
+    if (S->second->getParent() == M)
+      return;
+  typedef multimap<string, Function *>::iterator iterator;
+  for (Module::iterator G = M->begin(); G != M->end(); ++G) {
+    if (!G->isDeclaration())
+      TheEE->freeMachineCodeForFunction(G);
+    pair<iterator, iterator> R = Imports.equal_range(G->getName().str());
+    while (R.first != R.second)
+      if (R.first->second == G)
+        Imports.erase(R.first++);
+      else
+        ++R.first;
+  }
+  TheEE->clearGlobalMappingsFromModule(M);
+  TheEE->removeModule(M);
+  Modules.erase(M);
+  delete M;
+}
+
+void Kaleidoscope::DropScope(const string &S) {
+  map<string, Function *>::iterator B = Symbols.lower_bound(S), E = B;
+  while (E != Symbols.end() && E->first.compare(0, S.size(), S) == 0)
+    ++E;
+  vector<Function *> Dead;
+  set<Module *> Externs; // declarations may still be called in their module
+  for (map<string, Function *>::iterator I = B; I != E; ++I) {
+    if (I->second->isDeclaration()) {
+      Externs.insert(I->second->getParent());
+      continue;
+    }
+    Dead.push_back(I->second);
+    // their callers are all in the scope as well, forwarders can go
+    map<string, vector<Function *> >::iterator V = Versions.find(I->first);
+    if (V != Versions.end()) {
+      Dead.insert(Dead.end(), V->second.begin(), V->second.end());
+      Versions.erase(V);
+    }
+  }
+  Symbols.erase(B, E);
+  map<string, pair<string, FunctionAST *> >::iterator SB, SE;
+  SB = SE = Sources.lower_bound(S);
+  while (SE != Sources.end() && SE->first.compare(0, S.size(), S) == 0)
+    ++SE;
+  Sources.erase(SB, SE);
+  ScopedOperators.erase(S);
+  for (set<Module *>::iterator M = Externs.begin(); M != Externs.end(); ++M)
+    ReleaseModule(*M); // unless it has definitions, released below
+  for (unsigned i = 0; i < Dead.size(); i++)
+    Release(Dead[i]);
+}
+
+// ----------------------------------------------------------------------
+unsigned long ASTNode::Live = 0;
+size_t ASTNode::Bytes = 0;
+
+void *ASTNode::operator new(size_t size) {
+  ++Live;
+  Bytes += size;
+  return ::operator new(size);
+}
+
+void ASTNode::operator delete(void *p, size_t size) {
+  --Live;
+  Bytes -= size;
+  ::operator delete(p);
+}
+
+unsigned long ExprAST::Created = 0;
+
 // ----------------------------------------------------------------------
 NumberExprAST::NumberExprAST(double val) : Val(val) {}
 
 Value *NumberExprAST::Codegen(Kaleidoscope &ctx) {
+  ctx.EmitLocation(Loc);
   return ConstantFP::get(ctx.TheContext, APFloat(Val));
 }
 
@@ -76,11 +934,11 @@ Value *NumberExprAST::Codegen(Kaleidoscope &ctx) {
 VariableExprAST::VariableExprAST(const string &name) : Name(name) {}
 
 Value *VariableExprAST::Codegen(Kaleidoscope &ctx) {
+  ctx.EmitLocation(Loc);
   Value *V = ctx.NamedValues[Name];
   if (V == NULL)
-    return ValueError("Unknown variable name");
-  // load the value
-  return ctx.Builder.CreateLoad(V, Name.c_str());
+    return ValueError(Loc, "Unknown variable name");
+  return VariableValue(ctx, V, Name);
 }
 
 // ----------------------------------------------------------------------
@@ -91,14 +949,15 @@ Value *UnaryExprAST::Codegen(Kaleidoscope &ctx) {
   Value *V = Expr->Codegen(ctx);
   if (V == NULL)
     return NULL;
+  ctx.EmitLocation(Loc);
   // check for our unary -
   if (Op.lex_comp == Token::tokMinus)
     return ctx.Builder.CreateFNeg(V, "negtmp");
   // check for a user defined unary op
-  Function *F = ctx.TheModule->getFunction("unary" + Op.lexem);
+  Function *F = ctx.GetFunction("unary" + Op.lexem);
   if (F == NULL)
-    return ValueError("Invalid unary operator");
-  return ctx.Builder.CreateCall(F, V, "uniop");
+    return ValueError(Loc, "Invalid unary operator");
+  return MarkCall(ctx.Builder.CreateCall(F, V, "uniop"), F);
 }
 
 // ----------------------------------------------------------------------
@@ -110,6 +969,7 @@ Value *BinaryExprAST::Codegen(Kaleidoscope &ctx) {
   Value *R = RHS->Codegen(ctx);
   if (L == NULL || R == NULL)
     return NULL;
+  ctx.EmitLocation(Loc);
 
   switch (Op.lex_comp) {
   case Token::tokLT:
@@ -129,11 +989,11 @@ Value *BinaryExprAST::Codegen(Kaleidoscope &ctx) {
     break; // must be a user defined op
   }
   // check for user defined operators
-  Function *F = ctx.TheModule->getFunction("binary" + Op.lexem);
+  Function *F = ctx.GetFunction("binary" + Op.lexem);
   if (F == NULL)
-    return ValueError("Invalid binary operator");
+    return ValueError(Loc, "Invalid binary operator");
   Value *Ops[2] = { L, R };
-  return ctx.Builder.CreateCall(F, Ops, "binop");
+  return MarkCall(ctx.Builder.CreateCall(F, Ops, "binop"), F);
 }
 
 // ----------------------------------------------------------------------
@@ -141,12 +1001,20 @@ CallExprAST::CallExprAST(const string &callee, vector<ExprAST *> &args)
     : Callee(callee), Args(args) {}
 
 Value *CallExprAST::Codegen(Kaleidoscope &ctx) {
-  // lookup our function in the global module table
-  Function *CalleeF = ctx.TheModule->getFunction(Callee);
-  if (CalleeF == NULL)
-    return ValueError("Unknown function referenced");
-  if (CalleeF->arg_size() != Args.size())
-    return ValueError("Incorrect # of arguments");
+  // lookup our function in the current scope, then the global one
+  Function *CalleeF = ctx.GetFunction(Callee);
+  // user definitions shadow builtins, plain externs don't
+  bool ArrayOp = false;
+  if (CalleeF == NULL || !IsUserDefined(ctx, CalleeF)) {
+    if (Function *IntrinsicF = MathIntrinsic(ctx, Callee, Args.size()))
+      CalleeF = IntrinsicF;
+    else
+      ArrayOp = IsArrayBuiltin(Callee, Args.size());
+  }
+  if (CalleeF == NULL && !ArrayOp)
+    return ValueError(Loc, "Unknown function referenced");
+  if (!ArrayOp && CalleeF->arg_size() != Args.size())
+    return ValueError(Loc, "Incorrect # of arguments");
 
   vector<Value *> ArgsV;
   //for_each(Args.begin(), Args.end(), [](Value *arg) { ArgsV.push_back(arg);
@@ -156,7 +1024,11 @@ Value *CallExprAST::Codegen(Kaleidoscope &ctx) {
     if (ArgsV.back() == NULL)
       return NULL;
   }
-  return ctx.Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+  ctx.EmitLocation(Loc);
+  if (ArrayOp)
+    return ArrayCodegen(ctx, Callee, ArgsV);
+  CallInst *Call = ctx.Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+  return MarkCall(Call, CalleeF);
 }
 
 // ----------------------------------------------------------------------
@@ -164,40 +1036,58 @@ PrototypeAST::PrototypeAST(const string &name, const vector<string> &args,
                            const Token &op, pair<int, int> opprecassoc)
     : Name(name), Args(args), Op(op), opPrecAssoc(opprecassoc) {}
 
-// create allocas for all function arguments
+// create allocas for all function arguments (used as they are with
+// ctx.DirectSSA)
 void PrototypeAST::CreateArgumentAllocas(Kaleidoscope &ctx, Function *F) {
   Function::arg_iterator AI = F->arg_begin();
-  for (unsigned idx = 0; idx != Args.size(); ++idx, ++AI) {
-    // create an alloca for this variable
-    AllocaInst *A = CreateEntryBlockAlloca(ctx, Args[idx]);
-    // store the initial value into the alloca
-    ctx.Builder.CreateStore(AI, A);
-    // add args to variable-symbol-table
-    ctx.NamedValues[Args[idx]] = A;
-  }
+  for (unsigned idx = 0; idx != Args.size(); ++idx, ++AI)
+    BindVariable(ctx, Args[idx], AI); // add args to variable-symbol-table
+}
+
+// the function's name in the module, definitions go in the current scope
+string PrototypeAST::FunctionName(Kaleidoscope &ctx, bool Extern) const {
+  string FName = Name;
+  if (Name == "unary" || Name == "binary")
+    FName += Op.lexem;
+  if (!Extern && !Name.empty())
+    FName = ctx.Scope + FName;
+  return FName;
 }
 
 // http://llvm.org/releases/3.3/docs/tutorial/LangImpl3.html#id4
-Function *PrototypeAST::Codegen(Kaleidoscope &ctx) {
-  Function *F = NULL;
-  if ((F = ctx.TheModule->getFunction(Name)) == NULL) {
+Function *PrototypeAST::Codegen(Kaleidoscope &ctx, bool Extern) {
+  string FName = FunctionName(ctx, Extern);
+  // externs reuse what they name, definitions always get a new function in
+  // the current module (replacing the previous one, see Kaleidoscope::Define)
+  // and top-level expressions are never looked up
+  Function *F = Extern ? ctx.GetFunction(FName) : NULL;
+  Function *Prev = Extern || Name.empty() ? F : ctx.Lookup(FName);
+  // callers were compiled against the existing signature
+  if (Prev && Prev->arg_size() != Args.size())
+    return FunctionError(Loc, "Redefinition of function with wrong # of args");
+
+  // a reused module (see StartModule) may already declare FName, as an
+  // import or another scope's extern. LLVM would rename the new function
+  // (recursive calls would bind to that declaration, the JIT would look
+  // the extern up by the wrong name), so it goes in a module of its own
+  if (F == NULL && !Name.empty() && ctx.TheModule->getFunction(FName))
+    ctx.StartModule(true);
+
+  if (F == NULL) {
     // make the function type: double(double, double) ... etc.
     vector<Type *> DblArgs(Args.size(), Type::getDoubleTy(ctx.TheContext));
     FunctionType *FT = // returns a double, takes n-doubles, is not vararg
         FunctionType::get(Type::getDoubleTy(ctx.TheContext), DblArgs, false);
-    // register our function in TheModule with name Name
-    if (Name == "unary" || Name == "binary")
-      F = Function::Create(FT, Function::ExternalLinkage, Name + Op.lexem,
-                           ctx.TheModule);
+    // register our function in TheModule with name FName
+    if (Name.empty()) // readable name for profilers, counters, stats...
+      F = Function::Create(FT, Function::ExternalLinkage,
+                           ctx.AnonymousName("__anon_expr"), ctx.TheModule);
     else
-      F = Function::Create(FT, Function::ExternalLinkage, Name, ctx.TheModule);
+      F = Function::Create(FT, Function::ExternalLinkage, FName, ctx.TheModule);
+    if (Extern)
+      ctx.Define(ctx.Scope + FName, F);
   }
 
-  if (!F->empty()) // check the function es a forward decl if it exists
-    return FunctionError("Function cannot be redefined");
-  if (F->arg_size() != Args.size()) // defined and empty => extern, check # args
-    return FunctionError("Redefinition of function with wrong # of args");
-
   // set names for all arguments
   Function::arg_iterator AI = F->arg_begin();
   for (unsigned idx = 0; idx != Args.size(); ++AI, ++idx) {
@@ -205,8 +1095,10 @@ Function *PrototypeAST::Codegen(Kaleidoscope &ctx) {
   }
 
   // check if prototype defines an operator => install precedence/associativity
-  if (Name == "unary" || Name == "binary")
+  if ((Name == "unary" || Name == "binary") && ctx.Scope.empty())
     OperatorPrecedenceAssoc[Op] = opPrecAssoc;
+  else if (Name == "unary" || Name == "binary")
+    ScopedOperators[ctx.Scope][Op] = opPrecAssoc;
 
   return F;
 }
@@ -221,12 +1113,21 @@ Function *FunctionAST::Codegen(Kaleidoscope &ctx) {
   if (F == NULL)
     return NULL;
 
+  // the definition this one replaces, it keeps working until F is done
+  string Name = Proto->isAnonymous() ? "" : Proto->FunctionName(ctx);
+  Function *Old = Proto->isAnonymous() ? NULL : ctx.Lookup(Name);
+
   // Create a new basic block to start insertion into.
   BasicBlock *BB = BasicBlock::Create(ctx.TheContext, "entry", F);
   ctx.Builder.SetInsertPoint(BB);
 
+  if (ctx.DBuilder)
+    ctx.DIScope = DebugFunction(ctx, F, Proto->Loc.Line);
+  ctx.EmitLocation(SourceLoc()); // the prologue has no source location
+
   // add arguments to the symbol-table
   Proto->CreateArgumentAllocas(ctx, F);
+  uint64_t *Entry = EmitCounter(ctx, "entry", Proto->Loc);
 
   if (Value *RetVal = Body->Codegen(ctx)) {
     // finish off the function
@@ -234,10 +1135,59 @@ Function *FunctionAST::Codegen(Kaleidoscope &ctx) {
     //Validate the generated code, checking for consistency
     verifyFunction(*F);
 
-    // Optimize the function of the Optimizer is available
-    if (ctx.TheFPM != NULL)
+    // mark it pure if possible, including recursive calls to itself
+    InferPurity(F);
+    for (Function::iterator BB = F->begin(); BB != F->end(); ++BB)
+      for (BasicBlock::iterator I = BB->begin(); I != BB->end(); ++I)
+        if (CallInst *C = dyn_cast<CallInst>(I))
+          if (C->getCalledFunction() == F)
+            MarkCall(C, F);
+
+    // callers of a pure function may have hoisted or merged its calls
+    bool LessPure =
+        Old && ((Old->onlyReadsMemory() && !F->onlyReadsMemory()) ||
+                (Old->doesNotAccessMemory() && !F->doesNotAccessMemory()));
+
+    if (ctx.Stats) {
+      ctx.Stats->Last().Name = F->getName().str();
+      ctx.Stats->Last().InstsBefore = CountInstructions(F);
+      ctx.Stats->Switch(CompileStats::phOptimize);
+    }
+
+    // Optimize the function of the Optimizer is available, definitions
+    // only get the quick pipeline until they're hot when tiering
+    if (ctx.QuickFPM != NULL && Entry && !Proto->isAnonymous()) {
+      ctx.QuickFPM->run(*F);
+      ctx.Tier0[F] = Entry;
+    } else if (ctx.Batching && Proto->isAnonymous()) {
+      // optimized once inlined into the batch (Kaleidoscope::ParseBatch)
+    } else if (ctx.TheFPM != NULL) {
       ctx.TheFPM->run(*F);
+    }
+
+    if (ctx.Stats) {
+      ctx.Stats->Switch(CompileStats::phCodegen);
+      ctx.Stats->Last().InstsAfter = CountInstructions(F);
+    }
 
+    // top-level expressions run, everything they reach must be callable
+    if (Proto->isAnonymous())
+      if (Function *U = ctx.Unresolved(F)) {
+        string Msg = "Unresolved function '" + U->getName().str() + "'";
+        FunctionError(Proto->Loc, Msg.c_str());
+        F->eraseFromParent();
+        return NULL;
+      }
+    // the item is done and so is its module's compile unit, the JIT may
+    // compile F right away (Define). Batches go on, see ParseBatch
+    if (ctx.DBuilder && !(ctx.Batching && Proto->isAnonymous()))
+      ctx.DBuilder->finalize();
+    if (!Proto->isAnonymous()) {
+      ctx.Define(Name, F);
+      ctx.Sources[Name] = make_pair(ctx.Scope, this);
+      if (LessPure)
+        ctx.RecompileCallers(F);
+    }
     return F;
   }
   // Error reading body, remove function from fsym-tab to let usr redefine it
@@ -250,6 +1200,7 @@ IfExprAST::IfExprAST(ExprAST *cond, ExprAST *then, ExprAST *_else)
     : Cond(cond), Then(then), Else(_else) {}
 
 Value *IfExprAST::Codegen(Kaleidoscope &ctx) {
+  ctx.EmitLocation(Loc);
   Value *CondV = Cond->Codegen(ctx);
   if (CondV == NULL)
     return NULL;
@@ -271,13 +1222,15 @@ Value *IfExprAST::Codegen(Kaleidoscope &ctx) {
     ElseBB = BasicBlock::Create(ctx.TheContext, "else");
   BasicBlock *MergeBB = BasicBlock::Create(ctx.TheContext, "ifcont");
   // where to resume (even though these blocks are yet not inserted)
+  BranchInst *Br;
   if (Else)
-    ctx.Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+    Br = ctx.Builder.CreateCondBr(CondV, ThenBB, ElseBB);
   else
-    ctx.Builder.CreateCondBr(CondV, ThenBB, MergeBB);
+    Br = ctx.Builder.CreateCondBr(CondV, ThenBB, MergeBB);
 
   // Set the builder to emit at ThenBB
   ctx.Builder.SetInsertPoint(ThenBB);
+  uint64_t *ThenCount = EmitCounter(ctx, "then", Then->Loc);
   Value *ThenV = Then->Codegen(ctx);
   if (ThenV == NULL)
     return NULL;                 // TODO: cleanup?
@@ -287,10 +1240,12 @@ Value *IfExprAST::Codegen(Kaleidoscope &ctx) {
   ThenBB = ctx.Builder.GetInsertBlock();
 
   Value *ElseV = NULL;
+  uint64_t *ElseCount = NULL;
   if (Else) {
     // Emit the Else block, re-set the insertion point (see prev comment)
     F->getBasicBlockList().push_back(ElseBB);
     ctx.Builder.SetInsertPoint(ElseBB);
+    ElseCount = EmitCounter(ctx, "else", Else->Loc);
     ElseV = Else->Codegen(ctx);
     if (ElseV == NULL)
       return NULL;
@@ -299,6 +1254,14 @@ Value *IfExprAST::Codegen(Kaleidoscope &ctx) {
     ElseBB = ctx.Builder.GetInsertBlock();
   }
 
+  // remember where the arm counts are, tiering turns them into branch weights
+  if (ThenCount && ElseCount) {
+    Type *I64Ty = Type::getInt64Ty(ctx.TheContext);
+    Value *Slots[] = { ConstantInt::get(I64Ty, (uintptr_t)ThenCount),
+                       ConstantInt::get(I64Ty, (uintptr_t)ElseCount) };
+    Br->setMetadata("kaleidoscope.prof", MDNode::get(ctx.TheContext, Slots));
+  }
+
   // Emit the Merge block, re-set insertion point...
   F->getBasicBlockList().push_back(MergeBB);
   ctx.Builder.SetInsertPoint(MergeBB);
@@ -337,29 +1300,41 @@ Value *IfExprAST::Codegen(Kaleidoscope &ctx) {
 //   store nextvar -> var
 //   br endcond, loop, endloop
 // outloop:
+// with ctx.DirectSSA the variable is a phi instead of a stack slot:
+// loop:
+//   var = phi [start, preheader], [nextvar, loopend]
 
 ForExprAST::ForExprAST(const std::string &varname, ExprAST *start, ExprAST *end,
                        ExprAST *step, ExprAST *body)
     : VarName(varname), Start(start), End(end), Step(step), Body(body) {}
 
 Value *ForExprAST::Codegen(Kaleidoscope &ctx) {
+  ctx.EmitLocation(Loc);
   // Create the Alloca at the entry of the function and set it's start value
-  AllocaInst *A = CreateEntryBlockAlloca(ctx, VarName);
+  AllocaInst *A = ctx.DirectSSA ? NULL : CreateEntryBlockAlloca(ctx, VarName);
   Value *StartV = Start->Codegen(ctx);
   if (StartV == NULL)
     return NULL;
-  ctx.Builder.CreateStore(StartV, A);
+  if (A)
+    ctx.Builder.CreateStore(StartV, A);
 
   // get a handle on the function we're  inserting code into
-  Function *F = ctx.Builder.GetInsertBlock()->getParent();
+  BasicBlock *PreheaderBB = ctx.Builder.GetInsertBlock();
+  Function *F = PreheaderBB->getParent();
   BasicBlock *LoopBB = BasicBlock::Create(ctx.TheContext, "loop", F);
   ctx.Builder.CreateBr(LoopBB);
 
   ctx.Builder.SetInsertPoint(LoopBB);
+  PHINode *Var = NULL;
+  if (A == NULL) {
+    Var = ctx.Builder.CreatePHI(Type::getDoubleTy(ctx.TheContext), 2,
+                                VarName.c_str());
+    Var->addIncoming(StartV, PreheaderBB);
+  }
 
   // if the loop scope shadows a variable, keep it's old value
-  AllocaInst *OldVal = ctx.NamedValues[VarName];
-  ctx.NamedValues[VarName] = A;
+  Value *OldVal = ctx.NamedValues[VarName];
+  ctx.NamedValues[VarName] = A ? (Value *)A : Var;
 
   // generate Body now that the loop variable is in scope
   Value *BodyV = Body->Codegen(ctx);
@@ -382,17 +1357,29 @@ Value *ForExprAST::Codegen(Kaleidoscope &ctx) {
 
   // reload, increment, and restore the alloca (in case the body mutates the
   // variable)
-  Value *CurVal = ctx.Builder.CreateLoad(A, VarName.c_str());
+  Value *CurVal = A ? ctx.Builder.CreateLoad(A, VarName.c_str()) : Var;
   Value *NextVal = ctx.Builder.CreateFAdd(CurVal, StepV, "nextvar");
-  ctx.Builder.CreateStore(NextVal, A);
+  if (A)
+    ctx.Builder.CreateStore(NextVal, A);
 
   // convert condition to bool by comparing to 0.0
   EndV = ctx.Builder.CreateFCmpONE(
       EndV, ConstantFP::get(ctx.TheContext, APFloat(0.0)), "loopcond");
 
   // insert the block coming after the loop
+  BasicBlock *BackBB = LoopBB;
+  if (Counting(ctx)) // count taken back-edges on a block of their own
+    BackBB = BasicBlock::Create(ctx.TheContext, "loopback", F);
   BasicBlock *AfterBB = BasicBlock::Create(ctx.TheContext, "afterloop", F);
-  ctx.Builder.CreateCondBr(EndV, LoopBB, AfterBB); // condition to keep looping
+  ctx.Builder.CreateCondBr(EndV, BackBB, AfterBB); // condition to keep looping
+  if (Var) // the body may have ended in another block than it started
+    Var->addIncoming(NextVal, Counting(ctx) ? BackBB
+                                            : ctx.Builder.GetInsertBlock());
+  if (Counting(ctx)) {
+    ctx.Builder.SetInsertPoint(BackBB);
+    EmitCounter(ctx, "loop", Loc);
+    ctx.Builder.CreateBr(LoopBB);
+  }
   // continue writing after the loop
   ctx.Builder.SetInsertPoint(AfterBB);
 
@@ -406,4 +1393,168 @@ Value *ForExprAST::Codegen(Kaleidoscope &ctx) {
   return Constant::getNullValue(Type::getDoubleTy(ctx.TheContext));
 }
 
+// ----------------------------------------------------------------------
+// The body is outlined into a chunk function running iterations [lo, hi):
+//   double parfor(double *env, double start, double step, double lo, double hi)
+// captured variables are copied into env by the caller and re-bound inside,
+// the runtime (library.cc) splits the iterations across its thread pool and
+// combines the partial reductions returned by each chunk:
+//   parallelfor(parfor, env, start, end, step, reduction)
+
+ParallelForExprAST::ParallelForExprAST(const std::string &varname,
+                                       ExprAST *start, ExprAST *end,
+                                       ExprAST *step, ExprAST *body,
+                                       reduction red)
+    : ForExprAST(varname, start, end, step, body), Reduction(red) {}
+
+Function *ParallelForExprAST::OutlineBody(Kaleidoscope &ctx,
+                                          const vector<string> &Captures) {
+  Type *DblTy = Type::getDoubleTy(ctx.TheContext);
+  Type *ChunkArgs[] = { Type::getDoublePtrTy(ctx.TheContext), DblTy, DblTy,
+                        DblTy, DblTy };
+  FunctionType *FT = FunctionType::get(DblTy, ChunkArgs, false);
+  Function *F =
+      Function::Create(FT, Function::InternalLinkage, "parfor", ctx.TheModule);
+  Function::arg_iterator AI = F->arg_begin();
+  Value *Env = AI++;
+  Value *StartV = AI++;
+  Value *StepV = AI++;
+  Value *LoV = AI++;
+  Value *HiV = AI++;
+
+  BasicBlock *BB = BasicBlock::Create(ctx.TheContext, "entry", F);
+  ctx.Builder.SetInsertPoint(BB);
+  if (ctx.DBuilder)
+    ctx.DIScope = DebugFunction(ctx, F, Loc.Line);
+  ctx.EmitLocation(SourceLoc());
+
+  // re-bind captured variables from env
+  ctx.NamedValues.clear();
+  for (unsigned i = 0; i < Captures.size(); i++) {
+    Value *Ptr = ctx.Builder.CreateConstGEP1_32(Env, i);
+    BindVariable(ctx, Captures[i], ctx.Builder.CreateLoad(Ptr, Captures[i]));
+  }
+
+  // accumulator starts at the identity of the reduction, it and the
+  // iteration count k are phis in either codegen mode
+  APFloat Identity(0.0);
+  if (Reduction == redMin)
+    Identity = APFloat::getInf(APFloat::IEEEdouble, false);
+  else if (Reduction == redMax)
+    Identity = APFloat::getInf(APFloat::IEEEdouble, true);
+
+  BasicBlock *CondBB = BasicBlock::Create(ctx.TheContext, "cond", F);
+  BasicBlock *LoopBB = BasicBlock::Create(ctx.TheContext, "loop", F);
+  BasicBlock *AfterBB = BasicBlock::Create(ctx.TheContext, "afterloop", F);
+  BasicBlock *EntryBB = ctx.Builder.GetInsertBlock();
+  ctx.Builder.CreateBr(CondBB);
+
+  ctx.Builder.SetInsertPoint(CondBB);
+  PHINode *KV = ctx.Builder.CreatePHI(DblTy, 2, "k");
+  KV->addIncoming(LoV, EntryBB);
+  PHINode *Acc = ctx.Builder.CreatePHI(DblTy, 2, "acc");
+  Acc->addIncoming(ConstantFP::get(ctx.TheContext, Identity), EntryBB);
+  ctx.Builder.CreateCondBr(ctx.Builder.CreateFCmpULT(KV, HiV, "loopcond"),
+                           LoopBB, AfterBB);
+
+  // var = start + k * step, iteration k is independent of the others
+  ctx.Builder.SetInsertPoint(LoopBB);
+  BindVariable(ctx, VarName,
+               ctx.Builder.CreateFAdd(StartV, ctx.Builder.CreateFMul(KV, StepV),
+                                      VarName));
+  Value *BodyV = Body->Codegen(ctx);
+  if (BodyV == NULL) {
+    F->eraseFromParent();
+    return NULL;
+  }
+  Value *AccV = Acc;
+  switch (Reduction) {
+  case redSum:
+    AccV = ctx.Builder.CreateFAdd(AccV, BodyV, "sum");
+    break;
+  case redMin:
+    AccV = ctx.Builder.CreateSelect(ctx.Builder.CreateFCmpOLT(BodyV, AccV),
+                                    BodyV, AccV, "min");
+    break;
+  case redMax:
+    AccV = ctx.Builder.CreateSelect(ctx.Builder.CreateFCmpOGT(BodyV, AccV),
+                                    BodyV, AccV, "max");
+    break;
+  case redNone:
+    break;
+  }
+  Value *NextK = ctx.Builder.CreateFAdd(
+      KV, ConstantFP::get(ctx.TheContext, APFloat(1.0)), "nextk");
+  Acc->addIncoming(AccV, ctx.Builder.GetInsertBlock()); // the body's last
+  KV->addIncoming(NextK, ctx.Builder.GetInsertBlock());
+  ctx.Builder.CreateBr(CondBB);
+
+  ctx.Builder.SetInsertPoint(AfterBB);
+  ctx.Builder.CreateRet(Acc);
+
+  verifyFunction(*F);
+  if (ctx.TheFPM != NULL)
+    ctx.TheFPM->run(*F);
+  return F;
+}
+
+Value *ParallelForExprAST::Codegen(Kaleidoscope &ctx) {
+  ctx.EmitLocation(Loc);
+  Value *StartV = Start->Codegen(ctx);
+  if (StartV == NULL)
+    return NULL;
+  Value *EndV = End->Codegen(ctx);
+  if (EndV == NULL)
+    return NULL;
+  Value *StepV = NULL;
+  if (Step) {
+    StepV = Step->Codegen(ctx);
+    if (StepV == NULL)
+      return NULL;
+  } else {
+    StepV = ConstantFP::get(ctx.TheContext, APFloat(1.0));
+  }
+
+  // everything in scope is captured by value into an env array
+  Type *DblTy = Type::getDoubleTy(ctx.TheContext);
+  vector<string> Captures;
+  map<string, Value *>::iterator NV;
+  for (NV = ctx.NamedValues.begin(); NV != ctx.NamedValues.end(); ++NV)
+    Captures.push_back(NV->first);
+  BasicBlock *EB = &ctx.Builder.GetInsertBlock()->getParent()->getEntryBlock();
+  IRBuilder<> B(EB, EB->begin());
+  Value *Env = B.CreateAlloca(
+      DblTy,
+      ConstantInt::get(Type::getInt32Ty(ctx.TheContext),
+                       max<size_t>(Captures.size(), 1)),
+      "env");
+  for (unsigned i = 0; i < Captures.size(); i++) {
+    Value *V = VariableValue(ctx, ctx.NamedValues[Captures[i]], Captures[i]);
+    ctx.Builder.CreateStore(V, ctx.Builder.CreateConstGEP1_32(Env, i));
+  }
+
+  // outlining moves the builder, come back to where we were afterwards
+  BasicBlock *CallerBB = ctx.Builder.GetInsertBlock();
+  map<string, Value *> CallerNames = ctx.NamedValues;
+  MDNode *CallerScope = ctx.DIScope;
+  Function *Chunk = OutlineBody(ctx, Captures);
+  ctx.NamedValues = CallerNames;
+  ctx.Builder.SetInsertPoint(CallerBB);
+  ctx.DIScope = CallerScope;
+  ctx.EmitLocation(Loc);
+  if (Chunk == NULL)
+    return NULL;
+
+  Type *Int8PtrTy = Type::getInt8PtrTy(ctx.TheContext);
+  Type *RuntimeArgs[] = { Int8PtrTy, Type::getDoublePtrTy(ctx.TheContext),
+                          DblTy, DblTy, DblTy, DblTy };
+  FunctionType *FT = FunctionType::get(DblTy, RuntimeArgs, false);
+  Function *ParallelFor = cast<Function>(
+      ctx.TheModule->getOrInsertFunction("parallelfor", FT));
+  Value *RedV = ConstantFP::get(ctx.TheContext, APFloat((double)Reduction));
+  Value *Args[] = { ctx.Builder.CreateBitCast(Chunk, Int8PtrTy), Env, StartV,
+                    EndV, StepV, RedV };
+  return ctx.Builder.CreateCall(ParallelFor, Args, "parfor");
+}
+
 /* vim: set sw=2 sts=2  : */
@@ -6,31 +6,99 @@
 #include <llvm/PassManager.h>
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/DIBuilder.h>
+#include <llvm/DebugInfo.h>
 
+#include <stdint.h>
+#include <ostream>
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include <utility>
 
 #include "lexer.h"
+#include "memstats.h"
+#include "stats.h"
+
+class FunctionAST;
 
 class Kaleidoscope {
 public:
   llvm::LLVMContext &TheContext;
   llvm::IRBuilder<> Builder;
-  llvm::Module *TheModule;
+  llvm::Module *TheModule; // where new code goes, one per top-level item
+  std::set<llvm::Module *> Modules; // every live one, TheModule included
   llvm::FunctionPassManager *TheFPM;
   llvm::ExecutionEngine *TheEE;
-  std::map<std::string, llvm::AllocaInst *> NamedValues;
+  // variables in scope, stack slots or, with DirectSSA, their values
+  std::map<std::string, llvm::Value *> NamedValues;
+  CompileStats *Stats; // per-phase timing, NULL when disabled
+  llvm::DIBuilder *DBuilder; // source-level debug info, NULL when disabled
+  llvm::DIFile DIUnit;
+  llvm::MDNode *DIScope; // subprogram of the function being emitted
+  bool Instrument; // profile execution counts (library.h), tier-1 code too
+  llvm::FunctionPassManager *QuickFPM; // tier-0 pipeline, NULL unless tiering
+  unsigned HotThreshold; // calls before a definition is recompiled
+  std::map<llvm::Function *, uint64_t *> Tier0; // -> entry counter
+  std::map<llvm::Function *, std::pair<uint64_t *, llvm::Function *> >
+  Tier1; // promoted -> entry counter, tier-0 body (before inlining)
+  std::map<std::string, llvm::Function *> Symbols; // latest def/extern
+  std::multimap<std::string, llvm::Function *> Imports; // decls of those
+  std::map<std::string, std::vector<llvm::Function *> >
+  Versions; // superseded definitions (forwarders), oldest first
+  std::map<std::string, std::pair<std::string, FunctionAST *> >
+  Sources; // definitions -> their scope and AST, to recompile them
+  std::string Scope; // prefixes what's defined now, e.g. a server session
+  unsigned BatchSize;  // top-level expressions JIT'd together (ParseBatch)
+  double BatchWindow;  // ... or as many as parsed in these seconds (0 off)
+  bool Batching;       // expressions are optimized with their batch
+  CodeSizeListener *Code; // machine code alive, registered on TheEE
+  bool DirectSSA; // no allocas for arguments and loops (EnableDirectSSA)
+  unsigned long Anonymous; // expressions and batches named so far
 
 public:
   typedef double (*fptr)();
   Kaleidoscope();           // TODO: free resources
   fptr Parse(Lexer &lexer); // returns a func-pointer
+  bool ParseBatch(Lexer &lexer, std::vector<double> &results);
+  void EnableDebugInfo(const std::string &filename);
+  void EmitLocation(const SourceLoc &loc);
+  void EnableTiering(unsigned threshold);
+  void EnableDirectSSA(); // codegen builds SSA, pipelines skip mem2reg
+  void TierUp(); // recompile definitions that got hot
+  void StartModule(bool fresh = false); // unless the current one is empty
+  std::string AnonymousName(const char *prefix); // unique in the session
+  void Define(const std::string &name, llvm::Function *F);
+  void Redefine(llvm::Function *Old, llvm::Function *New);
+  void Invalidate(llvm::Function *F); // F's body changed
+  void RecompileCallers(llvm::Function *F); // F got side effects
+  llvm::Function *Lookup(const std::string &name); // in any module
+  llvm::Function *Declare(llvm::Function *F, llvm::Module *M = NULL); // in M
+  llvm::Function *GetFunction(const std::string &Name); // Scope's first
+  llvm::Function *Unresolved(llvm::Function *F); // what F can't call, if any
+  void Release(llvm::Function *F); // free F, and its module once empty
+  void ReleaseModule(llvm::Module *M); // free M if nothing in it is used
+  void DropScope(const std::string &scope); // free everything defined in it
+  MemoryStats Memory(); // what this engine (and the process's AST) holds
+};
+
+// AST nodes count their allocations, they're never freed after codegen
+class ASTNode {
+public:
+  static unsigned long Live; // # of nodes allocated and not deleted
+  static size_t Bytes;       // their size
+
+  static void *operator new(size_t size);
+  static void operator delete(void *p, size_t size);
 };
 
-class ExprAST {
+class ExprAST : public ASTNode {
 public:
+  static unsigned long Created; // # of nodes built so far (benchmarks)
+  SourceLoc Loc;                // where the expression starts
+
+  ExprAST() { ++Created; }
   virtual ~ExprAST() {}
   virtual llvm::Value *Codegen(Kaleidoscope &ctx) = 0;
 };
@@ -84,7 +152,11 @@ public:
 };
 
 // This represents a function signature
-class PrototypeAST {
+class PrototypeAST : public ASTNode {
+public:
+  SourceLoc Loc; // where the definition starts
+
+private:
   std::string Name;
   std::vector<std::string> Args;
   Token Op;
@@ -95,12 +167,14 @@ public:
                const Token &op = Token(),
                std::pair<int, int> opprecassoc = std::make_pair(30, -1));
 
+  bool isAnonymous() const { return Name.empty(); } // top-level expression
+  std::string FunctionName(Kaleidoscope &ctx, bool Extern = false) const;
   void CreateArgumentAllocas(Kaleidoscope &ctx, llvm::Function *);
-  virtual llvm::Function *Codegen(Kaleidoscope &ctx);
+  virtual llvm::Function *Codegen(Kaleidoscope &ctx, bool Extern = false);
 };
 
 // This represents an actual function definition
-class FunctionAST {
+class FunctionAST : public ASTNode {
   PrototypeAST *Proto;
   ExprAST *Body;
 
@@ -119,6 +193,7 @@ public:
 };
 
 class ForExprAST : public ExprAST {
+protected:
   std::string VarName;
   ExprAST *Start, *End, *Step, *Body;
 
@@ -128,6 +203,33 @@ public:
   virtual llvm::Value *Codegen(Kaleidoscope &ctx);
 };
 
+// Loop whose body is outlined and run in chunks on the runtime thread pool,
+// iterating var = start; var < end; var += step. Evaluates to the reduction
+// of the body values (0.0 when there's none)
+class ParallelForExprAST : public ForExprAST {
+public:
+  typedef enum reduction {
+    redNone = 0,
+    redSum = 1,
+    redMin = 2,
+    redMax = 3,
+  } reduction;
+
+private:
+  reduction Reduction;
+  llvm::Function *OutlineBody(Kaleidoscope &ctx,
+                              const std::vector<std::string> &captures);
+
+public:
+  ParallelForExprAST(const std::string &varname, ExprAST *start, ExprAST *end,
+                     ExprAST *step, ExprAST *body, reduction red);
+  virtual llvm::Value *Codegen(Kaleidoscope &ctx);
+};
+
+// Where parse and codegen errors go, cerr unless the thread sets its own
+// (the server replies with them)
+extern thread_local std::ostream *ErrorStream;
+
 // Parse a top-level, return <success, function ptr if aplicable>
 std::pair<bool, llvm::Function *> ParseNext(Lexer &lexer, Kaleidoscope &ctx);
 
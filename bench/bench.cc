@@ -0,0 +1,187 @@
+// Benchmarks for every stage of the pipeline over the checked-in corpora
+// (bench/corpus, see gen_corpus.cc). Results are appended to the file given
+// as second argument, one JSON object per line:
+//   {"bench": "lexer", "metric": "MB/s", "value": 123.4}
+// JIT'd workloads print to stdout, send it to /dev/null.
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include "../ast.h"
+#include "../library.h"
+
+using namespace std;
+
+static string Slurp(const string &path) {
+  ifstream in(path.c_str());
+  if (!in) {
+    cerr << "Can't read " << path << endl;
+    exit(1);
+  }
+  ostringstream os;
+  os << in.rdbuf();
+  return os.str();
+}
+
+static double Since(chrono::steady_clock::time_point t0) {
+  return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+class Results {
+  ofstream Out;
+
+public:
+  Results(const string &path) : Out(path.c_str(), ios::app) {}
+
+  void Add(const string &bench, const string &metric, double value) {
+    Out << "{\"bench\": \"" << bench << "\", \"metric\": \"" << metric
+        << "\", \"value\": " << value << "}" << endl;
+    cerr << bench << " " << metric << ": " << value << endl;
+  }
+};
+
+// Lexer throughput over the raw token stream
+static void BenchLexer(const string &src, Results &R) {
+  const unsigned reps = 20;
+  unsigned long tokens = 0;
+  chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+  for (unsigned i = 0; i < reps; i++) {
+    istringstream in(src);
+    Lexer lexer(in);
+    while (lexer.Next().lex_comp != Token::tokEOF)
+      tokens++;
+  }
+  double secs = Since(t0);
+  R.Add("lexer", "MB/s", src.size() * reps / secs / (1 << 20));
+  R.Add("lexer", "tokens/s", tokens / secs);
+}
+
+// Parser throughput through ParseNext (definitions get codegen'd as well)
+static void BenchParser(const string &src, Results &R) {
+  Kaleidoscope K;
+  istringstream in(src);
+  Lexer lexer(in);
+  lexer.Next(); // bootstrap the lexer
+  unsigned long nodes = ExprAST::Created;
+  chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+  while (lexer.Current().lex_comp != Token::tokEOF)
+    ParseNext(lexer, K);
+  double secs = Since(t0);
+  R.Add("parser", "nodes/s", (ExprAST::Created - nodes) / secs);
+}
+
+// Codegen + optimize (+ JIT for top-level expressions) latency per item,
+// with codegen through stack slots and mem2reg or building SSA directly
+static void BenchCodegen(const string &src, bool ssa, Results &R) {
+  const string bench = ssa ? "codegen-ssa" : "codegen";
+  Kaleidoscope K;
+  if (ssa)
+    K.EnableDirectSSA();
+  K.Stats = new CompileStats(); // IR size and optimize time of each item
+  istringstream in(src);
+  Lexer lexer(in);
+  lexer.Next(); // bootstrap the lexer
+  vector<double> lat;
+  unsigned long insts = 0, funcs = 0;
+  double optimize = 0;
+  while (lexer.Current().lex_comp != Token::tokEOF) {
+    if (lexer.Current().lex_comp == Token::tokSemicolon) {
+      lexer.Next(); // separators aren't items, don't sample them
+      continue;
+    }
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    K.Parse(lexer);
+    lat.push_back(Since(t0) * 1e6);
+    const CompileStats::Item &I = K.Stats->Last();
+    if (I.InstsBefore) { // a function was generated
+      insts += I.InstsBefore;
+      optimize += I.Seconds[CompileStats::phOptimize];
+      funcs++;
+    }
+  }
+  R.Add(bench, "IR insts/function", (double)insts / max(funcs, 1UL));
+  R.Add(bench, "optimize us/function", optimize * 1e6 / max(funcs, 1UL));
+  // compile latency shouldn't grow with the # of items compiled before
+  size_t tenth = max<size_t>(lat.size() / 10, 1);
+  double early = 0, late = 0;
+  for (size_t i = 0; i < tenth; i++) {
+    early += lat[i];
+    late += lat[lat.size() - 1 - i];
+  }
+  R.Add(bench, "late/early ratio", late / early);
+  sort(lat.begin(), lat.end());
+  double total = 0;
+  for (size_t i = 0; i < lat.size(); i++)
+    total += lat[i];
+  R.Add(bench, "us/item mean", total / lat.size());
+  R.Add(bench, "us/item p50", lat[lat.size() / 2]);
+  R.Add(bench, "us/item p99", lat[lat.size() * 99 / 100]);
+}
+
+// Compile + run throughput of a stream of items, top-level expressions
+// JIT'd one by one or in batches (Kaleidoscope::ParseBatch)
+static void BenchBatch(const string &src, unsigned batch, Results &R) {
+  Kaleidoscope K;
+  K.BatchSize = batch;
+  istringstream in(src);
+  Lexer lexer(in);
+  lexer.Next(); // bootstrap the lexer
+  unsigned long exprs = 0;
+  chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+  while (lexer.Current().lex_comp != Token::tokEOF) {
+    if (batch > 1) {
+      vector<double> results;
+      K.ParseBatch(lexer, results);
+      exprs += results.size();
+    } else if (double(*FP)() = K.Parse(lexer)) {
+      FP();
+      exprs++;
+    }
+  }
+  flushd();
+  ostringstream name;
+  name << "batch-" << batch;
+  R.Add(name.str(), "exprs/s", exprs / Since(t0));
+}
+
+// Execution time of the top-level expressions of a workload, compile
+// time excluded
+static void BenchExec(const string &name, const string &src, Results &R) {
+  Kaleidoscope K;
+  istringstream in(src);
+  Lexer lexer(in);
+  lexer.Next(); // bootstrap the lexer
+  double secs = 0;
+  while (lexer.Current().lex_comp != Token::tokEOF) {
+    if (double(*FP)() = K.Parse(lexer)) {
+      chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+      FP();
+      flushd();
+      secs += Since(t0);
+    }
+  }
+  R.Add("exec-" + name, "seconds", secs);
+}
+
+int main(int argc, char **argv) {
+  string dir = argc > 1 ? argv[1] : "bench/corpus";
+  Results R(argc > 2 ? argv[2] : "bench_output.txt");
+
+  BenchLexer(Slurp(dir + "/lexer.k"), R);
+  BenchParser(Slurp(dir + "/parser.k"), R);
+  BenchCodegen(Slurp(dir + "/codegen.k"), false, R);
+  BenchCodegen(Slurp(dir + "/codegen.k"), true, R);
+  BenchBatch(Slurp(dir + "/stream.k"), 1, R);
+  BenchBatch(Slurp(dir + "/stream.k"), 16, R);
+  BenchBatch(Slurp(dir + "/stream.k"), 256, R);
+  BenchExec("fib", Slurp(dir + "/fib.k"), R);
+  BenchExec("mandel", Slurp(dir + "/mandel.k"), R);
+  BenchExec("loops", Slurp(dir + "/loops.k"), R);
+
+  return 0;
+}
+
+/* vim: set sw=2 sts=2 : */
@@ -0,0 +1,62 @@
+// Output runtime throughput: the original per-character std::cout path vs
+// the buffered runtime in library.cc. Run with stdout sent to /dev/null,
+// results are reported on stderr.
+#include <chrono>
+#include <iostream>
+#include "../library.h"
+
+using namespace std;
+
+// what putchard used to be: one stream insertion per character
+static double putchard_unbuffered(double X) {
+  cout << (char)X;
+  return 0.0;
+}
+
+// called through pointers to mimic calls coming out of JIT'd code
+typedef double (*putfn)(double);
+static putfn volatile OldPut = putchard_unbuffered;
+static putfn volatile NewPut = putchard;
+
+static const size_t Bytes = 64 << 20;
+
+static double since(chrono::steady_clock::time_point t0) {
+  return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+static void report(const char *name, chrono::steady_clock::time_point t0) {
+  cerr << name << ": " << (Bytes / since(t0)) / (1 << 20) << " MB/s" << endl;
+}
+
+int main() {
+  chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+  for (size_t i = 0; i < Bytes; i++)
+    OldPut(i % 80 ? '*' : '\n');
+  cout.flush();
+  report("putchard (per-char cout)", t0);
+
+  t0 = chrono::steady_clock::now();
+  for (size_t i = 0; i < Bytes; i++)
+    NewPut(i % 80 ? '*' : '\n');
+  flushd();
+  report("putchard (buffered)", t0);
+
+  t0 = chrono::steady_clock::now();
+  for (size_t i = 0; i < Bytes; i += 80) {
+    putcharsd('*', 79);
+    putchard('\n');
+  }
+  flushd();
+  report("putcharsd (runs of 79)", t0);
+
+  t0 = chrono::steady_clock::now();
+  size_t n = Bytes / 16;
+  for (size_t i = 0; i < n; i++)
+    printd(i * 0.25);
+  flushd();
+  cerr << "printd: " << (n / since(t0)) / 1e6 << " M values/s" << endl;
+
+  return 0;
+}
+
+/* vim: set sw=2 sts=2 : */
@@ -0,0 +1,105 @@
+// Generates the checked-in benchmark corpora (make corpus). Output is fully
+// determined by the seed so regenerating never changes the files.
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static unsigned long Seed = 42;
+static unsigned Rand(unsigned n) { // LCG, libc rand() differs across systems
+  Seed = Seed * 6364136223846793005UL + 1442695040888963407UL;
+  return (Seed >> 33) % n;
+}
+
+// identifiers can't hold digits, spell the index out in letters
+static string Name(const char *prefix, unsigned idx) {
+  string s = prefix;
+  do {
+    s += char('a' + idx % 26);
+    idx /= 26;
+  } while (idx);
+  return s;
+}
+
+static string Number() {
+  ostringstream os;
+  if (Rand(2))
+    os << Rand(1000);
+  else
+    os << Rand(100) << "." << Rand(1000);
+  return os.str();
+}
+
+// random expression over x, y and the previously defined functions
+static string Expr(unsigned depth, unsigned nfuncs) {
+  static const char *ops[] = { "+", "-", "*", "/", "<" };
+  unsigned choice = depth == 0 ? Rand(2) : Rand(8);
+  switch (choice) {
+  case 0:
+    return Number();
+  case 1:
+    return Rand(2) ? "x" : "y";
+  case 2:
+    return "-" + Expr(depth - 1, nfuncs);
+  case 3:
+    return "(" + Expr(depth - 1, nfuncs) + ")";
+  case 4:
+    if (nfuncs > 0)
+      return Name("fn", Rand(nfuncs)) + "(" + Expr(depth - 1, nfuncs) + ", " +
+             Expr(depth - 1, nfuncs) + ")";
+  // fall through
+  case 5:
+    return "if " + Expr(depth - 1, nfuncs) + " then " +
+           Expr(depth - 1, nfuncs) + " else " + Expr(depth - 1, nfuncs);
+  default:
+    return Expr(depth - 1, nfuncs) + " " + ops[Rand(5)] + " " +
+           Expr(depth - 1, nfuncs);
+  }
+}
+
+static string Def(unsigned idx, unsigned depth) {
+  return "def " + Name("fn", idx) + "(x y)\n  " + Expr(depth, idx) + ";\n";
+}
+
+int main(int argc, char **argv) {
+  string dir = argc > 1 ? argv[1] : "bench/corpus";
+
+  // lexer: any token soup will do, sized to make timings stable
+  {
+    ofstream out((dir + "/lexer.k").c_str());
+    ostringstream os;
+    for (unsigned i = 0; os.tellp() < 256 * 1024; i++)
+      os << Def(i % 64, 4) << Expr(4, 64) << ";\n";
+    out << os.str();
+  }
+
+  // parser: a chain of definitions each calling the previous ones
+  {
+    ofstream out((dir + "/parser.k").c_str());
+    for (unsigned i = 0; i < 400; i++)
+      out << Def(i, 5);
+  }
+
+  // codegen: definitions of moderate size each JIT'd through a call
+  {
+    ofstream out((dir + "/codegen.k").c_str());
+    for (unsigned i = 0; i < 500; i++)
+      out << Def(i, 3) << Name("fn", i) << "(1, 2);\n";
+  }
+
+  // stream: a few definitions and then many small top-level expressions
+  {
+    ofstream out((dir + "/stream.k").c_str());
+    for (unsigned i = 0; i < 32; i++)
+      out << Def(i, 3);
+    for (unsigned i = 0; i < 4000; i++)
+      out << Name("fn", Rand(32)) << "(" << Number() << ", " << Number()
+          << ");\n";
+  }
+
+  return 0;
+}
+
+/* vim: set sw=2 sts=2 : */
@@ -0,0 +1,141 @@
+// Load generator for server.cc: N clients connect at once, each sends its
+// setup line (definitions of the session) and then R requests one at a time,
+// waiting for every reply. Reports requests/s and latency percentiles, the
+// results are appended as JSON lines like bench.cc does.
+//   loadgen [-socket=path] [-clients=N] [-requests=R] [-setup=line]
+//           [-request=line] [-out=file]
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static const char *Socket = "/tmp/kaleidoscope.sock";
+
+static double Since(chrono::steady_clock::time_point t0) {
+  return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+class Client {
+  int fd;
+  string pending;
+
+public:
+  Client() : fd(socket(AF_UNIX, SOCK_STREAM, 0)) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, Socket, sizeof(addr.sun_path) - 1);
+    if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+      perror(Socket);
+      exit(1);
+    }
+  }
+  ~Client() { close(fd); }
+
+  // send a request line and wait for its reply line
+  string Call(const string &line) {
+    string req = line + "\n";
+    for (size_t done = 0; done < req.size();) {
+      ssize_t n = write(fd, req.data() + done, req.size() - done);
+      if (n <= 0)
+        return "error disconnected";
+      done += n;
+    }
+    size_t eol;
+    while ((eol = pending.find('\n')) == string::npos) {
+      char buf[4096];
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n <= 0)
+        return "error disconnected";
+      pending.append(buf, n);
+    }
+    string reply = pending.substr(0, eol);
+    pending.erase(0, eol + 1);
+    return reply;
+  }
+};
+
+static double Percentile(vector<double> &v, double p) {
+  if (v.empty())
+    return 0.0;
+  size_t i = min(v.size() - 1, (size_t)(p * v.size()));
+  nth_element(v.begin(), v.begin() + i, v.end());
+  return v[i];
+}
+
+int main(int argc, char **argv) {
+  unsigned Clients = 8, Requests = 1000;
+  string Setup = "def fibl(n) if n < 2 then n else fibl(n-1) + fibl(n-2);";
+  string Request = "fibl(15);";
+  const char *Out = "bench_output.txt";
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "-socket=", 8) == 0)
+      Socket = argv[i] + 8;
+    else if (strncmp(argv[i], "-clients=", 9) == 0)
+      Clients = atoi(argv[i] + 9);
+    else if (strncmp(argv[i], "-requests=", 10) == 0)
+      Requests = atoi(argv[i] + 10);
+    else if (strncmp(argv[i], "-setup=", 7) == 0)
+      Setup = argv[i] + 7;
+    else if (strncmp(argv[i], "-request=", 9) == 0)
+      Request = argv[i] + 9;
+    else if (strncmp(argv[i], "-out=", 5) == 0)
+      Out = argv[i] + 5;
+    else {
+      cerr << "usage: " << argv[0]
+           << " [-socket=path] [-clients=N] [-requests=R] [-setup=line]"
+              " [-request=line] [-out=file]" << endl;
+      return 1;
+    }
+  }
+
+  vector<vector<double> > latency(Clients);
+  vector<unsigned> errors(Clients);
+  vector<thread> threads;
+  chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+  for (unsigned c = 0; c < Clients; c++)
+    threads.push_back(thread([&, c] {
+      Client client;
+      if (!Setup.empty() && client.Call(Setup).compare(0, 2, "ok") != 0)
+        errors[c]++;
+      for (unsigned r = 0; r < Requests; r++) {
+        chrono::steady_clock::time_point t = chrono::steady_clock::now();
+        if (client.Call(Request).compare(0, 2, "ok") != 0)
+          errors[c]++;
+        latency[c].push_back(Since(t));
+      }
+    }));
+  for (unsigned c = 0; c < threads.size(); c++)
+    threads[c].join();
+  double secs = Since(t0);
+
+  vector<double> all;
+  unsigned failed = 0;
+  for (unsigned c = 0; c < Clients; c++) {
+    all.insert(all.end(), latency[c].begin(), latency[c].end());
+    failed += errors[c];
+  }
+
+  ofstream results(Out, ios::app);
+  double values[] = { all.size() / secs, Percentile(all, 0.5) * 1e6,
+                      Percentile(all, 0.99) * 1e6, (double)failed };
+  const char *metrics[] = { "requests/s", "p50 us", "p99 us", "errors" };
+  for (unsigned i = 0; i < 4; i++) {
+    results << "{\"bench\": \"server\", \"metric\": \"" << metrics[i]
+            << "\", \"value\": " << values[i] << "}" << endl;
+    cerr << "server " << metrics[i] << ": " << values[i] << endl;
+  }
+  return failed != 0;
+}
+
+/* vim: set sw=2 sts=2 : */
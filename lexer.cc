@@ -1,92 +1,217 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "lexer.h"
 
 using namespace std;
 
-Token::Token() : lex_comp(lexic_component(0)), lexem("") {}
-Token::Token(lexic_component lex_comp, const string &lexem)
-    : lex_comp(lex_comp), lexem(lexem) {}
+Token::Token() : lex_comp(lexic_component(0)), lexem(""), number(0) {}
+Token::Token(lexic_component lex_comp, const string &lexem,
+             const SourceLoc &loc)
+    : lex_comp(lex_comp), lexem(lexem), loc(loc), number(0) {}
 bool Token::operator<(const Token &o) const { return lex_comp < o.lex_comp; }
 
+// ----------------------------------------------------------------------
+// Character classes (C locale), identifiers are letters and '_'
+enum { clSpace = 1, clDigit = 2, clIdent = 4 };
+
+static struct CharClasses {
+  unsigned char Of[256];
+  CharClasses() {
+    memset(Of, 0, sizeof(Of));
+    for (const char *c = " \t\n\v\f\r"; *c; c++)
+      Of[(unsigned char)*c] = clSpace;
+    for (int c = '0'; c <= '9'; c++)
+      Of[c] = clDigit;
+    for (int c = 'a'; c <= 'z'; c++)
+      Of[c] = Of[c - 'a' + 'A'] = clIdent;
+    Of['_'] = clIdent;
+  }
+} CharClass;
+
+// '\0's after the end of every line, in no class, so scans stop there and
+// 16 byte loads from anywhere in the line stay inside the buffer
+static const size_t Padding = 16;
+
+#ifdef __SSE2__
+static inline __m128i Between(__m128i v, char lo, char hi) {
+  // signed compares, bytes >= 0x80 are negative and never match
+  return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                       _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+
+static inline __m128i Matches(__m128i v, unsigned cls) {
+  switch (cls) {
+  case clSpace:
+    return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                        Between(v, '\t', '\r'));
+  case clDigit:
+    return Between(v, '0', '9');
+  default: // clIdent, setting 0x20 folds upper into lower case
+    return _mm_or_si128(
+        Between(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z'),
+        _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+  }
+}
+#endif
+
+// length of the run of chars of class cls at p
+static inline size_t Span(const char *p, unsigned cls) {
+  size_t n = 0;
+#ifdef __SSE2__
+  for (;; n += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + n));
+    unsigned miss = ~_mm_movemask_epi8(Matches(v, cls)) & 0xffff;
+    if (miss)
+      return n + __builtin_ctz(miss);
+  }
+#else
+  while (CharClass.Of[(unsigned char)p[n]] & cls)
+    n++;
+  return n;
+#endif
+}
+
+// ----------------------------------------------------------------------
+// Keywords by perfect hash: (2 * length + first + last char) % 16 is
+// collision free for this set, a single compare confirms the match
+static inline unsigned KeywordHash(const char *p, size_t n) {
+  return (2 * n + (unsigned char)p[0] + (unsigned char)p[n - 1]) & 15;
+}
+
+static struct KeywordTable {
+  struct Entry {
+    const char *name;
+    size_t len;
+    Token::lexic_component tok;
+  } Slot[16];
+
+  void Add(const char *name, Token::lexic_component tok) {
+    Entry &E = Slot[KeywordHash(name, strlen(name))];
+    E.name = name;
+    E.len = strlen(name);
+    E.tok = tok;
+  }
+
+  KeywordTable() {
+    for (unsigned i = 0; i < 16; i++) {
+      Slot[i].name = "";
+      Slot[i].len = 0; // never matches
+      Slot[i].tok = Token::tokId;
+    }
+    Add("def", Token::tokDef);
+    Add("extern", Token::tokExtern);
+    Add("if", Token::tokIf);
+    Add("then", Token::tokThen);
+    Add("else", Token::tokElse);
+    Add("for", Token::tokFor);
+    Add("in", Token::tokIn);
+    Add("binary", Token::tokBinary);
+    Add("unary", Token::tokUnary);
+    Add("parallel", Token::tokParallel);
+  }
+
+  Token::lexic_component Lookup(const char *p, size_t n) const {
+    const Entry &E = Slot[KeywordHash(p, n)];
+    if (E.len == n && memcmp(E.name, p, n) == 0)
+      return E.tok;
+    return Token::tokId;
+  }
+} Keywords;
+
+// ----------------------------------------------------------------------
+// digits ['.' digits], exact through Clinger's fast path when the digits fit
+// in 53 bits and the scale is a power of ten doubles represent exactly
+static double DecodeNumber(const char *p, size_t n) {
+  static const double Pow10[] = { 1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                  1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                  1e18, 1e19, 1e20, 1e21, 1e22 };
+  const uint64_t Max = 1ULL << 53;
+  uint64_t m = 0;
+  unsigned scale = 0;
+  bool frac = false;
+  for (size_t i = 0; i < n; i++) {
+    if (p[i] == '.') {
+      frac = true;
+      continue;
+    }
+    if (m > (Max - 9) / 10 || scale == 22)
+      return strtod(string(p, n).c_str(), NULL); // slow but correct
+    m = m * 10 + (p[i] - '0');
+    scale += frac;
+  }
+  return (double)m / Pow10[scale];
+}
+
+// ----------------------------------------------------------------------
 Lexer::Lexer(istream &input)
-    : input(input), current(Token(Token::tokEOF, "")) {}
+    : input(input), current(Token(Token::tokEOF, "")), buf(Padding, '\0'),
+      at(0), end(0), line(0), Timer(NULL) {}
 const Token &Lexer::Current() { return current; }
 
 const Token &Lexer::Next() {
+  if (Timer == NULL) {
+    current = next();
+    current.loc = start;
+    return current;
+  }
+  chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
   current = next();
+  current.loc = start;
+  *Timer += chrono::duration<double>(chrono::steady_clock::now() - t0).count();
   return current;
 }
 
+// read the next line, the buffer's capacity is reused
+bool Lexer::fill() {
+  if (!getline(input, buf))
+    return false;
+  buf += '\n';
+  end = buf.size();
+  buf.append(Padding, '\0');
+  at = 0;
+  line++;
+  return true;
+}
+
 Token Lexer::next() {
-  string lexem;
-  int last = ' ';
   // consume all white space
-  while (isspace(last))
-    last = input.get();
-
-  if (input.eof())
-    return Token(Token::tokEOF, "");
-
-  // tokenize numbers
-  if (isdigit(last)) {
-    do {
-      lexem.append(1, last);
-      last = input.get();
-    } while (isdigit(last));
-
-    if (last != '.') {
-      input.putback(last);
-      return Token(Token::tokNumber, lexem);
+  while ((at += Span(&buf[at], clSpace)) == end) {
+    if (!fill()) {
+      start = SourceLoc(line, at);
+      return Token(Token::tokEOF, "");
     }
+  }
+  start = SourceLoc(line, at + 1);
+  const char *p = &buf[at];
+  unsigned char c = *p;
 
-    // get decimal separator
-    lexem.append(1, last);
-    last = input.get();
-    if (!isdigit(last)) {
-      input.putback(last);
-      return Token(Token::tokNumber, lexem);
-    }
-
-    // get decimal part
-    do {
-      lexem.append(1, last);
-      last = input.get();
-    } while (isdigit(last));
-    input.putback(last);
-
-    return Token(Token::tokNumber, lexem);
+  // tokenize numbers
+  if (CharClass.Of[c] & clDigit) {
+    size_t n = Span(p, clDigit);
+    if (p[n] == '.') // decimal separator and part
+      n += 1 + Span(p + n + 1, clDigit);
+    at += n;
+    Token T(Token::tokNumber, string(p, n));
+    T.number = DecodeNumber(p, n);
+    return T;
   }
 
   // tokenize commands/identifiers
-  if (isalpha(last) || last == '_') {
-    do {
-      lexem.append(1, last);
-      last = input.get();
-    } while (isalpha(last) || last == '_');
-    input.putback(last);
-
-    if (lexem == "def")
-      return Token(Token::tokDef, lexem);
-    if (lexem == "extern")
-      return Token(Token::tokExtern, lexem);
-    if (lexem == "if")
-      return Token(Token::tokIf, lexem);
-    if (lexem == "then")
-      return Token(Token::tokThen, lexem);
-    if (lexem == "else")
-      return Token(Token::tokElse, lexem);
-    if (lexem == "for")
-      return Token(Token::tokFor, lexem);
-    if (lexem == "in")
-      return Token(Token::tokIn, lexem);
-    if (lexem == "binary")
-      return Token(Token::tokBinary, lexem);
-    if (lexem == "unary")
-      return Token(Token::tokUnary, lexem);
-    return Token(Token::tokId, lexem);
+  if (CharClass.Of[c] & clIdent) {
+    size_t n = Span(p, clIdent);
+    at += n;
+    return Token(Keywords.Lookup(p, n), string(p, n));
   }
 
   // don't know what this is
-  return Token(Token::lexic_component(last), string(1, last));
+  at++;
+  return Token(Token::lexic_component(c), string(1, c));
 }
 
 /* vim: set sw=2 sts=2 : */
@@ -4,6 +4,12 @@
 #include <istream>
 #include <string>
 
+// 1-based position in the source, 0:0 when unknown
+struct SourceLoc {
+  unsigned Line, Col;
+  SourceLoc(unsigned line = 0, unsigned col = 0) : Line(line), Col(col) {}
+};
+
 class Token {
 public:
   typedef enum lexic_component {
@@ -22,6 +28,7 @@ public:
     tokIn = -10,
     tokBinary = -11,
     tokUnary = -12,
+    tokParallel = -13,
     // explicitly enumerate some used by parser
     tokSemicolon = ';',
     tokOParen = '(',
@@ -37,19 +44,31 @@ public:
 
   lexic_component lex_comp;
   std::string lexem;
+  SourceLoc loc; // where the token starts
+  double number; // value of a tokNumber, decoded by the lexer
 
   Token(); // Null value is lex_comp = 0, lexem = ""
-  Token(lexic_component lex_comp, const std::string &lexem);
+  Token(lexic_component lex_comp, const std::string &lexem,
+        const SourceLoc &loc = SourceLoc());
 
   bool operator<(const Token &o) const;
 };
 
+// Input is read a line at a time (tokens never span lines) into a buffer
+// that's scanned with character class tables, SIMD where available
 class Lexer {
   std::istream &input;
   Token current;
+  std::string buf; // current line incl. '\n', then padding for SIMD loads
+  size_t at, end;  // next char to read, end of the line in buf
+  unsigned line;   // # of the line in buf
+  SourceLoc start; // of the current token
+  bool fill();
   Token next();
 
 public:
+  double *Timer; // when set, seconds spent lexing are added here
+
   Lexer(std::istream &input);
   const Token &Next();
   const Token &Current();
@@ -1,9 +1,477 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "library.h"
+
+using namespace std;
+
+// set while a parallel loop runs, runtime state is only locked then
+static atomic<bool> InParallel(false);
+// set for good once several host threads run JIT'd code (ShareOutput)
+static atomic<bool> SharedOutput(false);
+
+// Output written by JIT'd code is gathered here and handed to std::cout in
+// large blocks instead of one stream insertion per character
+class OutputBuffer {
+  char Buf[1 << 16];
+  size_t Len;
+
+public:
+  mutex Lock;
+
+  OutputBuffer() : Len(0) {}
+  ~OutputBuffer() { Flush(); } // flush-at-exit
+
+  void Flush() {
+    if (Len == 0)
+      return;
+    cout.write(Buf, Len);
+    cout.flush();
+    Len = 0;
+  }
+
+  void Put(char c) {
+    if (Len == sizeof(Buf))
+      Flush();
+    Buf[Len++] = c;
+  }
+
+  void Fill(char c, size_t n) {
+    while (n > 0) {
+      if (Len == sizeof(Buf))
+        Flush();
+      size_t chunk = min(n, sizeof(Buf) - Len);
+      memset(Buf + Len, c, chunk);
+      Len += chunk;
+      n -= chunk;
+    }
+  }
+
+  void Write(const char *s, size_t n) {
+    if (n > sizeof(Buf) - Len)
+      Flush();
+    if (n > sizeof(Buf)) { // too big to buffer, pass it straight through
+      cout.write(s, n);
+      return;
+    }
+    memcpy(Buf + Len, s, n);
+    Len += n;
+  }
+};
+
+static OutputBuffer Output;
+
+// only pay for the lock when JIT'd code may be running on several threads
+class OutputGuard {
+  bool Locked;
+
+public:
+  OutputGuard()
+      : Locked(InParallel.load(memory_order_relaxed) ||
+               SharedOutput.load(memory_order_relaxed)) {
+    if (Locked)
+      Output.Lock.lock();
+  }
+  ~OutputGuard() {
+    if (Locked)
+      Output.Lock.unlock();
+  }
+};
 
 extern "C" // unmangled name
 double putchard(double X) {
-  std::cout << (char)X;
+  OutputGuard G;
+  Output.Put((char)X);
+  return 0.0;
+}
+
+extern "C" double putcharsd(double X, double N) {
+  OutputGuard G;
+  if (N > 0)
+    Output.Fill((char)X, (size_t)N);
+  return 0.0;
+}
+
+extern "C" double printd(double X) {
+  char num[512]; // fits any %f formatted double
+  int n = snprintf(num, sizeof(num), "%f\n", X);
+  OutputGuard G;
+  Output.Write(num, (size_t)n);
+  return 0.0;
+}
+
+extern "C" double flushd() {
+  OutputGuard G;
+  Output.Flush();
   return 0.0;
 }
 
+void ShareOutput() { SharedOutput = true; }
+
+// ----------------------------------------------------------------------
+// Arrays are bump-allocated out of large arena blocks and only released all
+// together (ResetArrays), lengths are kept aside so the data stays contiguous.
+// Every owner (see SetArrayOwner) bumps blocks of its own so its arrays can
+// be released apart from the others' (ReleaseArrays)
+class ArrayArena {
+  static const size_t BlockSize = 1 << 20;
+  static const size_t Align = 64; // cache line
+  struct Pool {
+    vector<char *> Blocks;
+    size_t Used;
+    size_t Reserved, Handed; // bytes in Blocks, bytes given to arrays
+    vector<const double *> Arrays; // allocated or wrapped for the owner
+    Pool() : Used(BlockSize), Reserved(0), Handed(0) {}
+  };
+  map<unsigned, Pool> Pools;
+  map<const double *, size_t> Lengths;
+  mutable mutex Lock; // arrays may be allocated from parallel loops
+
+public:
+  // longest array whose size in bytes, rounded up to Align, fits a size_t
+  static const size_t MaxLength =
+      (numeric_limits<size_t>::max() - Align) / sizeof(double);
+
+  ~ArrayArena() { Reset(); }
+
+  double *Alloc(size_t n, unsigned owner) {
+    if (n > MaxLength)
+      throw bad_alloc();
+    // empty arrays take a slot too, every array needs an address of its own
+    size_t bytes = (max(n, (size_t)1) * sizeof(double) + Align - 1) &
+                   ~(Align - 1);
+    lock_guard<mutex> G(Lock);
+    Pool &P = Pools[owner];
+    char *mem;
+    if (bytes > BlockSize / 4) { // big arrays get a block on their own
+      mem = NewBlock(P, bytes);
+      P.Blocks.insert(P.Blocks.begin(), mem); // keep bumping the current one
+    } else {
+      if (P.Used + bytes > BlockSize) {
+        P.Blocks.push_back(NewBlock(P, BlockSize));
+        P.Used = 0;
+      }
+      mem = P.Blocks.back() + P.Used;
+      P.Used += bytes;
+    }
+    memset(mem, 0, bytes);
+    P.Handed += bytes;
+    P.Arrays.push_back((double *)mem);
+    Lengths[(double *)mem] = n;
+    return (double *)mem;
+  }
+
+  void Register(const double *data, size_t n, unsigned owner) {
+    lock_guard<mutex> G(Lock);
+    Pools[owner].Arrays.push_back(data);
+    Lengths[data] = n;
+  }
+
+  size_t Length(const double *data) const {
+    lock_guard<mutex> G(Lock);
+    map<const double *, size_t>::const_iterator L = Lengths.find(data);
+    return L == Lengths.end() ? 0 : L->second;
+  }
+
+  void Release(unsigned owner) {
+    lock_guard<mutex> G(Lock);
+    map<unsigned, Pool>::iterator P = Pools.find(owner);
+    if (P == Pools.end())
+      return;
+    for (size_t i = 0; i < P->second.Arrays.size(); i++)
+      Lengths.erase(P->second.Arrays[i]);
+    for (size_t i = 0; i < P->second.Blocks.size(); i++)
+      free(P->second.Blocks[i]);
+    Pools.erase(P);
+  }
+
+  void Reset() {
+    lock_guard<mutex> G(Lock);
+    map<unsigned, Pool>::iterator P;
+    for (P = Pools.begin(); P != Pools.end(); ++P)
+      for (size_t i = 0; i < P->second.Blocks.size(); i++)
+        free(P->second.Blocks[i]);
+    Pools.clear();
+    Lengths.clear();
+  }
+
+  void Usage(RuntimeMemory &M) const {
+    lock_guard<mutex> G(Lock);
+    M.ArenaBytes = M.ArrayBytes = 0;
+    map<unsigned, Pool>::const_iterator P;
+    for (P = Pools.begin(); P != Pools.end(); ++P) {
+      M.ArenaBytes += P->second.Reserved;
+      M.ArrayBytes += P->second.Handed;
+    }
+    M.Arrays = Lengths.size();
+  }
+
+private:
+  char *NewBlock(Pool &P, size_t bytes) {
+    void *mem = NULL;
+    if (posix_memalign(&mem, Align, bytes) != 0)
+      throw bad_alloc();
+    P.Reserved += bytes;
+    return (char *)mem;
+  }
+};
+
+static ArrayArena Arrays;
+static thread_local unsigned ArrayOwner = 0; // see SetArrayOwner
+
+static_assert(sizeof(double *) == sizeof(double),
+              "array handles need pointers to fit in a double");
+
+static double ToHandle(const double *data) {
+  double handle;
+  memcpy(&handle, &data, sizeof(handle));
+  return handle;
+}
+
+static const double *FromHandle(double handle) {
+  const double *data;
+  memcpy(&data, &handle, sizeof(data));
+  return data;
+}
+
+extern "C" double arrayalloc(double N) {
+  size_t n = 0;
+  if (N > 0) // converting doubles past size_t is undefined
+    n = N <= ArrayArena::MaxLength ? (size_t)N : ArrayArena::MaxLength + 1;
+  return ToHandle(Arrays.Alloc(n, ArrayOwner));
+}
+
+extern "C" double arraylen(double A) {
+  return (double)Arrays.Length(FromHandle(A));
+}
+
+double WrapArray(double *Data, size_t Len) {
+  Arrays.Register(Data, Len, ArrayOwner);
+  return ToHandle(Data);
+}
+
+void ResetArrays() { Arrays.Reset(); }
+
+void SetArrayOwner(unsigned Owner) { ArrayOwner = Owner; }
+
+void ReleaseArrays(unsigned Owner) { Arrays.Release(Owner); }
+
+// ----------------------------------------------------------------------
+// Fixed pool of workers running parallel loops (ParallelForExprAST). A loop
+// is cut into chunks that workers and the calling thread claim in turn.
+class ThreadPool {
+  vector<thread> Workers;
+  mutex Lock;
+  condition_variable Wake, Done;
+  function<void()> Job; // current loop, run by every worker
+  unsigned long Generation;
+  unsigned Busy;
+  bool Stop;
+
+  void Work() {
+    InWorker = true;
+    unsigned long seen = 0;
+    unique_lock<mutex> L(Lock);
+    while (true) {
+      Wake.wait(L, [&] { return Stop || Generation != seen; });
+      if (Stop)
+        return;
+      seen = Generation;
+      L.unlock();
+      Job();
+      L.lock();
+      if (--Busy == 0)
+        Done.notify_one();
+    }
+  }
+
+public:
+  static thread_local bool InWorker;
+
+  ThreadPool(unsigned n) : Generation(0), Busy(0), Stop(false) {
+    for (unsigned i = 0; i < n; i++)
+      Workers.push_back(thread(&ThreadPool::Work, this));
+  }
+
+  ~ThreadPool() {
+    {
+      lock_guard<mutex> L(Lock);
+      Stop = true;
+    }
+    Wake.notify_all();
+    for (size_t i = 0; i < Workers.size(); i++)
+      Workers[i].join();
+  }
+
+  unsigned Size() const { return Workers.size() + 1; } // + calling thread
+
+  // run job on every thread of the pool (the caller included) and wait
+  void Run(const function<void()> &job) {
+    unique_lock<mutex> L(Lock);
+    Job = job;
+    Busy = Workers.size();
+    Generation++;
+    Wake.notify_all();
+    L.unlock();
+    job();
+    L.lock();
+    Done.wait(L, [&] { return Busy == 0; });
+  }
+};
+
+thread_local bool ThreadPool::InWorker = false;
+
+static ThreadPool &Pool() {
+  static unsigned n = thread::hardware_concurrency();
+  static ThreadPool pool(n > 1 ? n - 1 : 0);
+  return pool;
+}
+
+typedef double (*ParallelChunk)(double *Env, double Start, double Step,
+                                double Lo, double Hi);
+
+extern "C" double parallelfor(void *Chunk, double *Env, double Start,
+                              double End, double Step, double Reduction) {
+  ParallelChunk chunk = (ParallelChunk)Chunk;
+  double iters = Step > 0 && End > Start ? ceil((End - Start) / Step) : 0;
+  int red = (int)Reduction;
+
+  // nested loops and loops run from several host threads at once go serial
+  static mutex RunLock;
+  unique_lock<mutex> L(RunLock, defer_lock);
+  if (ThreadPool::InWorker || !L.try_lock() || Pool().Size() == 1)
+    return chunk(Env, Start, Step, 0, iters);
+
+  // a few chunks per thread to even out irregular iterations
+  size_t nchunks = min<double>(iters, Pool().Size() * 4);
+  vector<double> partial(nchunks);
+  atomic<size_t> next(0);
+  unsigned owner = ArrayOwner; // arrays allocated by the body are the caller's
+  InParallel = true;
+  Pool().Run([&] {
+    bool worker = ThreadPool::InWorker;
+    unsigned prev = ArrayOwner;
+    ThreadPool::InWorker = true;
+    ArrayOwner = owner;
+    for (size_t c; (c = next++) < nchunks;) {
+      double lo = floor(iters * c / nchunks);
+      double hi = floor(iters * (c + 1) / nchunks);
+      partial[c] = chunk(Env, Start, Step, lo, hi);
+    }
+    ThreadPool::InWorker = worker;
+    ArrayOwner = prev;
+  });
+  InParallel = false;
+
+  // combine in chunk order so sums don't depend on scheduling
+  double result = 0.0;
+  if (red == 2)
+    result = numeric_limits<double>::infinity();
+  else if (red == 3)
+    result = -numeric_limits<double>::infinity();
+  for (size_t c = 0; c < nchunks; c++) {
+    if (red == 1)
+      result += partial[c];
+    else if (red == 2)
+      result = min(result, partial[c]);
+    else if (red == 3)
+      result = max(result, partial[c]);
+  }
+  return result;
+}
+
+// ----------------------------------------------------------------------
+// Counter slots live in a deque so their addresses, baked into JIT'd code,
+// stay valid as more are added
+class CounterTable {
+  struct Counter {
+    string Function, Kind;
+    unsigned Line, Col;
+    uint64_t Count;
+  };
+  deque<Counter> Counters;
+  mutex Lock;
+
+public:
+  string DumpPath; // dumped on destruction when set
+
+  ~CounterTable() {
+    if (DumpPath.empty())
+      return;
+    if (DumpPath == "-") {
+      Dump(cerr);
+      return;
+    }
+    ofstream out(DumpPath.c_str());
+    Dump(out);
+  }
+
+  uint64_t *New(const string &function, const string &kind, unsigned line,
+                unsigned col) {
+    lock_guard<mutex> G(Lock);
+    Counter C = { function, kind, line, col, 0 };
+    Counters.push_back(C);
+    return &Counters.back().Count;
+  }
+
+  void Usage(RuntimeMemory &M) {
+    lock_guard<mutex> G(Lock);
+    M.Counters = Counters.size();
+    M.CounterBytes = Counters.size() * sizeof(Counter);
+    for (size_t i = 0; i < Counters.size(); i++)
+      M.CounterBytes +=
+          Counters[i].Function.capacity() + Counters[i].Kind.capacity();
+  }
+
+  void Dump(ostream &out) {
+    lock_guard<mutex> G(Lock);
+    out << "# kaleidoscope counters v1" << endl;
+    for (size_t i = 0; i < Counters.size(); i++) {
+      const Counter &C = Counters[i];
+      out << C.Count << "\t" << C.Kind << "\t" << C.Function << "\t" << C.Line
+          << ":" << C.Col << "\n";
+    }
+    out.flush();
+  }
+};
+
+static CounterTable Counters;
+
+uint64_t *NewCounter(const string &Function, const string &Kind,
+                     unsigned Line, unsigned Col) {
+  return Counters.New(Function, Kind, Line, Col);
+}
+
+void DumpCounters(ostream &out) { Counters.Dump(out); }
+
+void DumpCountersAtExit(const string &path) { Counters.DumpPath = path; }
+
+extern "C" double dumpcounters() {
+  flushd(); // keep the program's own output first
+  DumpCounters(cerr);
+  return 0.0;
+}
+
+// ----------------------------------------------------------------------
+RuntimeMemory GetRuntimeMemory() {
+  RuntimeMemory M;
+  Arrays.Usage(M);
+  Counters.Usage(M);
+  M.OutputBytes = sizeof(Output);
+  return M;
+}
+
 /* vim: set sw=2 sts=2 : */
@@ -0,0 +1,70 @@
+#ifndef _LIBRARY_H_
+#define _LIBRARY_H_
+
+#include <cstddef>
+#include <ostream>
+#include <stdint.h>
+#include <string>
+
+// Runtime available to JIT'd code (library.cc). All take and return doubles
+// so they can be declared from Kaleidoscope with 'extern'.
+extern "C" {
+double putchard(double X);            // buffered write of a single char
+double putcharsd(double X, double N); // write char X, N times in one call
+double printd(double X);              // formatted double followed by newline
+double flushd();                      // flush the output buffer
+
+// Arrays are handed around as doubles holding the bits of the base pointer,
+// element access is emitted inline by codegen (see CallExprAST::Codegen)
+double arrayalloc(double N); // zeroed array of N doubles from the arena
+double arraylen(double A);   // # of elements, 0 for unknown handles
+
+// Runs a 'parallel for' chunk function (see ParallelForExprAST) over the
+// iterations start, start + step, ... < end on the runtime thread pool.
+// Reduction is 0 none, 1 sum, 2 min, 3 max
+double parallelfor(void *Chunk, double *Env, double Start, double End,
+                   double Step, double Reduction);
+
+double dumpcounters(); // execution counters to stderr (see DumpCounters)
+}
+
+// The host runs JIT'd code from several threads (see server.cc), output is
+// locked from now on
+void ShareOutput();
+
+// Host side of arrays: expose caller-owned memory to Kaleidoscope without
+// copying (Data must outlive its use) and release every array at once
+double WrapArray(double *Data, size_t Len);
+void ResetArrays();
+
+// Arrays allocated (or wrapped) from this thread from now on belong to Owner,
+// 0 by default, parallel loops pass it on to their workers. ReleaseArrays
+// frees the arrays of a single owner, e.g. a server session that ended
+void SetArrayOwner(unsigned Owner);
+void ReleaseArrays(unsigned Owner);
+
+// Execution counters bumped by instrumented code (Kaleidoscope::Instrument).
+// The slot returned is fixed for the life of the process. Dumps are one
+// counter per line, in creation order, after a version header:
+//   # kaleidoscope counters v1
+//   <count>\t<kind>\t<function>\t<line>:<col>
+// with kind one of entry, then, else or loop (back-edges taken)
+uint64_t *NewCounter(const std::string &Function, const std::string &Kind,
+                     unsigned Line, unsigned Col);
+void DumpCounters(std::ostream &out);
+void DumpCountersAtExit(const std::string &path); // "-" for stderr
+
+// Memory held by the runtime (see Kaleidoscope::Memory)
+struct RuntimeMemory {
+  size_t ArenaBytes;    // reserved by the array arena
+  size_t ArrayBytes;    // handed out of it
+  unsigned long Arrays; // allocated or wrapped, until ResetArrays
+  unsigned long Counters;
+  size_t CounterBytes;
+  size_t OutputBytes; // output buffer
+};
+RuntimeMemory GetRuntimeMemory();
+
+#endif // _LIBRARY_H_
+
+/* vim: set sw=2 sts=2 : */
@@ -3,27 +3,54 @@
 
 using namespace std;
 
-// Error handling
-static ExprAST *ExprError(const char *error) {
-  cerr << error << endl;
+// Error handling, errors point at the current token
+static ExprAST *ExprError(Lexer &lexer, const char *error) {
+  const SourceLoc &Loc = lexer.Current().loc;
+  *ErrorStream << Loc.Line << ":" << Loc.Col << ": " << error << endl;
   return NULL;
 }
-static PrototypeAST *ProtoError(const char *error) {
-  ExprError(error);
+static PrototypeAST *ProtoError(Lexer &lexer, const char *error) {
+  ExprError(lexer, error);
   return NULL;
 }
 
-// Op-Token => <precedence, associativity (-1 left, 1 right)>
+// tag a node with where it starts in the source
+static ExprAST *At(const SourceLoc &Loc, ExprAST *E) {
+  E->Loc = Loc;
+  return E;
+}
+
+// while parsing the end of a 'parallel for', the loop variable and whether
+// the end mentions it (see ParseForExpr)
+static const string *BoundVar = NULL;
+static bool BoundVarSeen = false;
+
+// Op-Token => <precedence, associativity (-1 left, 1 right)>. Operators
+// defined in a scope (see Kaleidoscope::Scope) are only seen while parsing
+// in it, and go with it
 map<Token, pair<int, int> > OperatorPrecedenceAssoc;
+map<string, map<Token, pair<int, int> > > ScopedOperators;
+static string OperatorScope; // of the item being parsed (ParseNext)
+
+static const pair<int, int> *OpPrecAssoc(const Token &op) {
+  map<Token, pair<int, int> >::iterator O;
+  if (!OperatorScope.empty()) {
+    map<string, map<Token, pair<int, int> > >::iterator S =
+        ScopedOperators.find(OperatorScope);
+    if (S != ScopedOperators.end() &&
+        (O = S->second.find(op)) != S->second.end())
+      return &O->second;
+  }
+  O = OperatorPrecedenceAssoc.find(op);
+  return O == OperatorPrecedenceAssoc.end() ? NULL : &O->second;
+}
 int OpPrec(const Token &op) {
-  if (OperatorPrecedenceAssoc.find(op) == OperatorPrecedenceAssoc.end())
-    return -1;
-  return OperatorPrecedenceAssoc[op].first;
+  const pair<int, int> *P = OpPrecAssoc(op);
+  return P ? P->first : -1;
 }
 int OpAssoc(const Token &op) {
-  if (OperatorPrecedenceAssoc.find(op) == OperatorPrecedenceAssoc.end())
-    return -1;
-  return OperatorPrecedenceAssoc[op].second;
+  const pair<int, int> *P = OpPrecAssoc(op);
+  return P ? P->second : -1;
 }
 
 bool checkValidOp(const string &lexem) {
@@ -42,45 +69,65 @@ static ExprAST *ParsePrimary(Lexer &lexer);
 
 // ifexpr ::= 'if' expression 'then' expression ('else' expression)?
 static ExprAST *ParseIfExpr(Lexer &lexer) {
+  SourceLoc Loc = lexer.Current().loc;
   lexer.Next(); // eat 'if'
   ExprAST *Cond = ParseExpression(lexer);
   if (Cond == NULL)
     return NULL;
   // parse the branch for the condition being met
   if (lexer.Current().lex_comp != Token::tokThen)
-    return ExprError("Expected 'then' in conditional");
+    return ExprError(lexer, "Expected 'then' in conditional");
   lexer.Next(); // eat 'then'
   ExprAST *Then = ParseExpression(lexer);
   if (Then == NULL)
     return NULL;
   // check if there's an else clause
   if (lexer.Current().lex_comp != Token::tokElse)
-    return new IfExprAST(Cond, Then, NULL);
+    return At(Loc, new IfExprAST(Cond, Then, NULL));
   lexer.Next(); // eat 'else'
   ExprAST *Else = ParseExpression(lexer);
   if (Else == NULL)
     return NULL;
-  return new IfExprAST(Cond, Then, Else);
+  return At(Loc, new IfExprAST(Cond, Then, Else));
 }
 
 // forexpr ::= 'for' id '=' expr ',' expr (',' expr)? 'in' expression
-static ExprAST *ParseForExpr(Lexer &lexer) {
+// the second expr is the loop condition, for parallel loops it's the end
+// bound instead (evaluated once, before the loop) and can't use the variable
+static ExprAST *ParseForExpr(Lexer &lexer, bool Parallel = false,
+                             ParallelForExprAST::reduction Reduction =
+                                 ParallelForExprAST::redNone) {
+  SourceLoc Loc = lexer.Current().loc;
   lexer.Next(); // eat 'for'
   if (lexer.Current().lex_comp != Token::tokId)
-    return ExprError("Expected identifier in for-expression");
+    return ExprError(lexer, "Expected identifier in for-expression");
   string LoopId = lexer.Current().lexem;
   if (lexer.Next().lex_comp != Token::tokAssign)
-    return ExprError("Expected '=' after Id in for-expression");
+    return ExprError(lexer, "Expected '=' after Id in for-expression");
   lexer.Next(); // eat '='
   ExprAST *Start = ParseExpression(lexer);
   if (Start == NULL)
     return NULL;
   if (lexer.Current().lex_comp != Token::tokComma)
-    return ExprError("Expected ',' after for start expression");
+    return ExprError(lexer, "Expected ',' after for start expression");
   lexer.Next(); // eat ','
+  SourceLoc EndLoc = lexer.Current().loc;
+  const string *OuterVar = BoundVar; // loops nested in an end expression
+  bool OuterSeen = BoundVarSeen;
+  BoundVar = Parallel ? &LoopId : NULL;
+  BoundVarSeen = false;
   ExprAST *End = ParseExpression(lexer);
-  if (Start == NULL)
+  bool EndUsesVar = BoundVarSeen;
+  BoundVar = OuterVar;
+  BoundVarSeen = OuterSeen;
+  if (End == NULL)
+    return NULL;
+  if (EndUsesVar) {
+    *ErrorStream << EndLoc.Line << ":" << EndLoc.Col
+                 << ": 'parallel for' takes an end value, not a condition on "
+                 << LoopId << endl;
     return NULL;
+  }
   ExprAST *Step = NULL;
   if (lexer.Current().lex_comp == Token::tokComma) {
     lexer.Next(); // eat ','
@@ -89,12 +136,34 @@ static ExprAST *ParseForExpr(Lexer &lexer) {
       return NULL;
   }
   if (lexer.Current().lex_comp != Token::tokIn)
-    return ExprError("Expected 'in' after for end/step expression");
+    return ExprError(lexer, "Expected 'in' after for end/step expression");
   lexer.Next(); // eat 'in'
   ExprAST *Body = ParseExpression(lexer);
   if (Body == NULL)
     return NULL;
-  return new ForExprAST(LoopId, Start, End, Step, Body);
+  if (Parallel)
+    return At(Loc, new ParallelForExprAST(LoopId, Start, End, Step, Body,
+                                          Reduction));
+  return At(Loc, new ForExprAST(LoopId, Start, End, Step, Body));
+}
+
+// parforexpr ::= 'parallel' ('sum'|'min'|'max')? forexpr
+static ExprAST *ParseParallelForExpr(Lexer &lexer) {
+  ParallelForExprAST::reduction Reduction = ParallelForExprAST::redNone;
+  if (lexer.Next().lex_comp == Token::tokId) { // eat 'parallel'
+    if (lexer.Current().lexem == "sum")
+      Reduction = ParallelForExprAST::redSum;
+    else if (lexer.Current().lexem == "min")
+      Reduction = ParallelForExprAST::redMin;
+    else if (lexer.Current().lexem == "max")
+      Reduction = ParallelForExprAST::redMax;
+    else
+      return ExprError(lexer, "Expected 'sum', 'min' or 'max' reduction");
+    lexer.Next(); // eat reduction
+  }
+  if (lexer.Current().lex_comp != Token::tokFor)
+    return ExprError(lexer, "Expected 'for' after 'parallel'");
+  return ParseForExpr(lexer, true, Reduction);
 }
 
 // unary ::= primary | '!' unary
@@ -105,18 +174,20 @@ static ExprAST *ParseUnary(Lexer &lexer) {
   Token Op = lexer.Current();
   lexer.Next(); // eat op
   if (ExprAST *operand = ParseUnary(lexer))
-    return new UnaryExprAST(Op, operand);
+    return At(Op.loc, new UnaryExprAST(Op, operand));
   return NULL;
 }
 
 // primary ::= idexpr | numexpr | parenexpr | '-' primary | ifexpr | forexpr
+//           | parforexpr
 // NOTE because of the way we implement op-precedence grammar unary operators
 // have greater precedence than binary ones
 static ExprAST *ParsePrimary(Lexer &lexer) {
+  SourceLoc Loc = lexer.Current().loc;
   switch (lexer.Current().lex_comp) {
   // numberexpr
   case Token::tokNumber: {
-    ExprAST *Num = new NumberExprAST(stod(lexer.Current().lexem));
+    ExprAST *Num = At(Loc, new NumberExprAST(lexer.Current().number));
     lexer.Next(); // eat number
     return Num;
   }
@@ -128,7 +199,7 @@ static ExprAST *ParsePrimary(Lexer &lexer) {
     if (expr == NULL)
       return NULL;
     if (lexer.Current().lex_comp != Token::tokCParen)
-      return ExprError("Expected ')'");
+      return ExprError(lexer, "Expected ')'");
     lexer.Next(); // eat ')'
     return expr;
   }
@@ -137,8 +208,10 @@ static ExprAST *ParsePrimary(Lexer &lexer) {
   case Token::tokId: {
     string IdName = lexer.Current().lexem;
     // Check if this is a function call (eating the identifier)
-    if (lexer.Next().lex_comp != Token::tokOParen)
-      return new VariableExprAST(IdName);
+    if (lexer.Next().lex_comp != Token::tokOParen) {
+      BoundVarSeen = BoundVarSeen || (BoundVar && *BoundVar == IdName);
+      return At(Loc, new VariableExprAST(IdName));
+    }
     lexer.Next(); // eat '('
     vector<ExprAST *> Args;
     // Parse function arguments
@@ -151,12 +224,12 @@ static ExprAST *ParsePrimary(Lexer &lexer) {
         if (lexer.Current().lex_comp == Token::tokCParen)
           break;
         if (lexer.Current().lex_comp != Token::tokComma)
-          return ExprError("Expected ')' or ',' in argument list");
+          return ExprError(lexer, "Expected ')' or ',' in argument list");
         lexer.Next(); // eat ','
       }
     }
     lexer.Next(); // eat ')'
-    return new CallExprAST(IdName, Args);
+    return At(Loc, new CallExprAST(IdName, Args));
   }
 
   // '-' primary
@@ -166,16 +239,18 @@ static ExprAST *ParsePrimary(Lexer &lexer) {
     ExprAST *expr = ParsePrimary(lexer);
     if (expr == NULL)
       return NULL;
-    return new UnaryExprAST(Op, expr);
+    return At(Loc, new UnaryExprAST(Op, expr));
   }
 
   // ifexpr
   case Token::tokIf: { return ParseIfExpr(lexer); }
   // forexpr
   case Token::tokFor: { return ParseForExpr(lexer); }
+  // parforexpr
+  case Token::tokParallel: { return ParseParallelForExpr(lexer); }
 
   default:
-    return ExprError("Unknown token. Expected expression");
+    return ExprError(lexer, "Unknown token. Expected expression");
   }
 }
 
@@ -203,7 +278,7 @@ static ExprAST *ParseBinOpRHS(Lexer &lexer, int ExprPrec, ExprAST *LHS) {
         return NULL;
     }
     // Merge LHS/RHS
-    LHS = new BinaryExprAST(BinOp, LHS, RHS);
+    LHS = At(BinOp.loc, new BinaryExprAST(BinOp, LHS, RHS));
   }
 }
 
@@ -219,6 +294,7 @@ static ExprAST *ParseExpression(Lexer &lexer) {
 //           ::= 'binary' id num (left|right)? '(' id id ')'
 //           ::= 'unary' id '(' id ')' // no precedence for unary ops...
 static PrototypeAST *ParseFuncProto(Lexer &lexer) {
+  SourceLoc Loc = lexer.Current().loc;
   string FnName = "";
   Token Op;
   unsigned BinPrec = 30; // default precedence
@@ -226,7 +302,7 @@ static PrototypeAST *ParseFuncProto(Lexer &lexer) {
   switch (lexer.Current().lex_comp) {
   default:
     return ProtoError(
-        "Expected function name or 'binary' or 'unary' in prototype");
+        lexer, "Expected function name or 'binary' or 'unary' in prototype");
   case Token::tokId:
     FnName = lexer.Current().lexem;
     lexer.Next(); // eat id
@@ -235,13 +311,13 @@ static PrototypeAST *ParseFuncProto(Lexer &lexer) {
   case Token::tokBinary:
     FnName = "binary";
     if (!checkValidOp(lexer.Next().lexem))
-      return ProtoError("Expected binary operator");
+      return ProtoError(lexer, "Expected binary operator");
     Op = lexer.Current();
     if (lexer.Next().lex_comp != Token::tokNumber)
-      return ProtoError("Expected binary op precedence");
-    BinPrec = (unsigned) stoi(lexer.Current().lexem);
+      return ProtoError(lexer, "Expected binary op precedence");
+    BinPrec = (unsigned)lexer.Current().number;
     if (BinPrec < 1 || BinPrec > 100)
-      return ProtoError("Expected precedence between 1 and 100");
+      return ProtoError(lexer, "Expected precedence between 1 and 100");
     // parse binary operator associativity
     if (lexer.Next().lex_comp == Token::tokId) {
       if (lexer.Current().lexem == "left")
@@ -249,7 +325,7 @@ static PrototypeAST *ParseFuncProto(Lexer &lexer) {
       else if (lexer.Current().lexem == "right")
         Assoc = -1;
       else
-        return ProtoError("Expected 'left' or 'right' associativity");
+        return ProtoError(lexer, "Expected 'left' or 'right' associativity");
       lexer.Next(); // eat 'left'|'right'
     }
     break;
@@ -257,7 +333,7 @@ static PrototypeAST *ParseFuncProto(Lexer &lexer) {
   case Token::tokUnary:
     FnName = "unary";
     if (!checkValidOp(lexer.Next().lexem))
-      return ProtoError("Expected unary operator");
+      return ProtoError(lexer, "Expected unary operator");
     Op = lexer.Current();
     lexer.Next(); // eat op
     break;
@@ -265,20 +341,23 @@ static PrototypeAST *ParseFuncProto(Lexer &lexer) {
 
   // Get the parameter list (eating the identifier)
   if (lexer.Current().lex_comp != Token::tokOParen)
-    return ProtoError("Expected '(' in prototype");
+    return ProtoError(lexer, "Expected '(' in prototype");
   // Get the list of argument names (eating the initial '(')
   vector<string> ArgNames;
   while (lexer.Next().lex_comp == Token::tokId)
     ArgNames.push_back(lexer.Current().lexem);
   if (lexer.Current().lex_comp != Token::tokCParen)
-    return ProtoError("Expected ')' in prototype");
+    return ProtoError(lexer, "Expected ')' in prototype");
   lexer.Next(); // eat ')'
 
   if ((FnName == "binary" && ArgNames.size() != 2) ||
       (FnName == "unary" && ArgNames.size() != 1))
-    return ProtoError("Invalid number of operands for operator");
+    return ProtoError(lexer, "Invalid number of operands for operator");
 
-  return new PrototypeAST(FnName, ArgNames, Op, make_pair(BinPrec, Assoc));
+  PrototypeAST *Proto =
+      new PrototypeAST(FnName, ArgNames, Op, make_pair(BinPrec, Assoc));
+  Proto->Loc = Loc;
+  return Proto;
 }
 
 // definition ::= 'def' prototype expression
@@ -301,16 +380,19 @@ static PrototypeAST *ParseExtern(Lexer &lexer) {
 // toplevelexpr ::= expression
 // allow to parse arbitrary expressions wrapped in a null function
 static FunctionAST *ParseTopLevelExpr(Lexer &lexer) {
+  SourceLoc Loc = lexer.Current().loc;
   if (ExprAST *expr = ParseExpression(lexer)) {
     PrototypeAST *proto = new PrototypeAST("", vector<string>());
+    proto->Loc = Loc;
     return new FunctionAST(proto, expr);
   }
   return NULL;
 }
 
 // top ::= definition | external | expression | ';'
-// returns true for success, false if any parse errors, and a F if applicable
+// returns true for success, false on parse or codegen errors, and a F if any
 pair<bool, llvm::Function *> ParseNext(Lexer &lexer, Kaleidoscope &ctx) {
+  OperatorScope = ctx.Scope;
   switch (lexer.Current().lex_comp) {
   case Token::tokEOF:
     return make_pair(true, (llvm::Function *)NULL);
@@ -321,26 +403,50 @@ pair<bool, llvm::Function *> ParseNext(Lexer &lexer, Kaleidoscope &ctx) {
     return make_pair(true, (llvm::Function *)NULL);
 
   case Token::tokDef:
+    if (ctx.Stats)
+      ctx.Stats->BeginItem(lexer);
     if (FunctionAST *F = ParseFuncDef(lexer)) {
-      F->Codegen(ctx);
-      return make_pair(true, (llvm::Function *)NULL);
+      if (ctx.Stats)
+        ctx.Stats->Switch(CompileStats::phCodegen);
+      bool Ok = F->Codegen(ctx) != NULL;
+      if (ctx.Stats)
+        ctx.Stats->EndItem("def");
+      return make_pair(Ok, (llvm::Function *)NULL);
     }
     break;
 
   case Token::tokExtern:
+    if (ctx.Stats)
+      ctx.Stats->BeginItem(lexer);
     if (PrototypeAST *P = ParseExtern(lexer)) {
-      P->Codegen(ctx);
-      return make_pair(true, (llvm::Function *)NULL);
+      if (ctx.Stats)
+        ctx.Stats->Switch(CompileStats::phCodegen);
+      llvm::Function *F = P->Codegen(ctx, true);
+      if (ctx.Stats) {
+        ctx.Stats->Last().Name = F ? F->getName().str() : "";
+        ctx.Stats->EndItem("extern");
+      }
+      return make_pair(F != NULL, (llvm::Function *)NULL);
     }
     break;
 
   default:
-    if (FunctionAST *F = ParseTopLevelExpr(lexer))
-      return make_pair(true, F->Codegen(ctx));
+    if (ctx.Stats)
+      ctx.Stats->BeginItem(lexer);
+    if (FunctionAST *F = ParseTopLevelExpr(lexer)) {
+      if (ctx.Stats)
+        ctx.Stats->Switch(CompileStats::phCodegen);
+      llvm::Function *LF = F->Codegen(ctx);
+      if (ctx.Stats)
+        ctx.Stats->EndItem("expr");
+      return make_pair(LF != NULL, LF);
+    }
     break;
   }
 
   lexer.Next(); // skip token for error recovery
+  if (ctx.Stats)
+    ctx.Stats->EndItem("error");
   return make_pair(false, (llvm::Function *)NULL);
 }
 
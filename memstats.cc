@@ -0,0 +1,171 @@
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <algorithm>
+#include <iomanip>
+
+#include "ast.h"
+#include "memstats.h"
+
+using namespace std;
+using namespace llvm;
+
+FunctionMemory &FunctionMemory::operator+=(const FunctionMemory &o) {
+  Versions += o.Versions;
+  Blocks += o.Blocks;
+  Instructions += o.Instructions;
+  IRBytes += o.IRBytes;
+  CodeVersions += o.CodeVersions;
+  CodeBytes += o.CodeBytes;
+  return *this;
+}
+
+MemoryStats::MemoryStats()
+    : ASTNodes(0), ASTBytes(0), Modules(0), Functions(0), Declarations(0) {
+  Runtime = RuntimeMemory();
+}
+
+FunctionMemory MemoryStats::InScope(const string &scope) const {
+  FunctionMemory M;
+  map<string, FunctionMemory>::const_iterator F;
+  for (F = PerFunction.lower_bound(scope);
+       F != PerFunction.end() && F->first.compare(0, scope.size(), scope) == 0;
+       ++F)
+    M += F->second;
+  return M;
+}
+
+size_t MemoryStats::Bytes() const {
+  return ASTBytes + Total.IRBytes + Total.CodeBytes + Runtime.ArenaBytes +
+         Runtime.CounterBytes + Runtime.OutputBytes;
+}
+
+void MemoryStats::PrintSummary(ostream &out) const {
+  out << "Memory " << Bytes() << " bytes" << endl;
+  out << "  AST       " << setw(12) << ASTBytes << " bytes  " << ASTNodes
+      << " nodes" << endl;
+  out << "  IR        " << setw(12) << Total.IRBytes << " bytes  " << Modules
+      << " modules, " << Functions << " functions (" << Declarations
+      << " declarations), " << Total.Instructions << " instructions" << endl;
+  out << "  code      " << setw(12) << Total.CodeBytes << " bytes  "
+      << Total.CodeVersions << " functions" << endl;
+  out << "  arrays    " << setw(12) << Runtime.ArenaBytes << " bytes  "
+      << Runtime.Arrays << " arrays using " << Runtime.ArrayBytes << endl;
+  out << "  counters  " << setw(12) << Runtime.CounterBytes << " bytes  "
+      << Runtime.Counters << " counters" << endl;
+  out << "  output    " << setw(12) << Runtime.OutputBytes << " bytes" << endl;
+
+  vector<pair<size_t, string> > largest;
+  map<string, FunctionMemory>::const_iterator F;
+  for (F = PerFunction.begin(); F != PerFunction.end(); ++F)
+    largest.push_back(
+        make_pair(F->second.IRBytes + F->second.CodeBytes, F->first));
+  sort(largest.rbegin(), largest.rend());
+  out << "Largest functions (IR + code):" << endl;
+  for (size_t i = 0; i < largest.size() && i < 10; i++) {
+    const FunctionMemory &M = PerFunction.find(largest[i].second)->second;
+    out << "  " << setw(10) << largest[i].first << " bytes  "
+        << largest[i].second << " (" << M.Versions << " IR, "
+        << M.CodeVersions << " code versions)" << endl;
+  }
+}
+
+void MemoryStats::DumpJSON(ostream &out) const {
+  out << "{\"ast_nodes\": " << ASTNodes << ", \"ast_bytes\": " << ASTBytes
+      << ", \"modules\": " << Modules << ", \"functions\": " << Functions
+      << ", \"declarations\": " << Declarations
+      << ", \"instructions\": " << Total.Instructions
+      << ", \"ir_bytes\": " << Total.IRBytes
+      << ", \"code_bytes\": " << Total.CodeBytes
+      << ", \"arena_bytes\": " << Runtime.ArenaBytes
+      << ", \"array_bytes\": " << Runtime.ArrayBytes
+      << ", \"arrays\": " << Runtime.Arrays
+      << ", \"counters\": " << Runtime.Counters
+      << ", \"counter_bytes\": " << Runtime.CounterBytes
+      << ", \"output_bytes\": " << Runtime.OutputBytes
+      << ",\n \"per_function\": [";
+  map<string, FunctionMemory>::const_iterator F;
+  for (F = PerFunction.begin(); F != PerFunction.end(); ++F) {
+    const FunctionMemory &M = F->second;
+    out << (F == PerFunction.begin() ? "\n  " : ",\n  ") << "{\"name\": \""
+        << F->first << "\", \"versions\": " << M.Versions
+        << ", \"blocks\": " << M.Blocks
+        << ", \"instructions\": " << M.Instructions
+        << ", \"ir_bytes\": " << M.IRBytes
+        << ", \"code_versions\": " << M.CodeVersions
+        << ", \"code_bytes\": " << M.CodeBytes << "}";
+  }
+  out << "\n]}" << endl;
+}
+
+// ----------------------------------------------------------------------
+void CodeSizeListener::NotifyFunctionEmitted(
+    const Function &F, void *Code, size_t Size,
+    const EmittedFunctionDetails &Details) {
+  Live[Code] = make_pair(F.getName().str(), Size);
+  Bytes += Size;
+}
+
+void CodeSizeListener::NotifyFreeingMachineCode(void *OldPtr) {
+  map<void *, pair<string, size_t> >::iterator L = Live.find(OldPtr);
+  if (L == Live.end())
+    return;
+  Bytes -= L->second.second;
+  Live.erase(L);
+}
+
+void CodeSizeListener::Collect(map<string, FunctionMemory> &per) const {
+  map<void *, pair<string, size_t> >::const_iterator L;
+  for (L = Live.begin(); L != Live.end(); ++L) {
+    FunctionMemory &M = per[L->second.first];
+    M.CodeVersions++;
+    M.CodeBytes += L->second.second;
+  }
+}
+
+// ----------------------------------------------------------------------
+// Estimated from the size of the objects making up F, operands included
+static FunctionMemory IRSize(const Function *F) {
+  FunctionMemory M;
+  M.Versions = 1;
+  M.IRBytes = sizeof(Function) + F->arg_size() * sizeof(Argument);
+  for (Function::const_iterator B = F->begin(); B != F->end(); ++B) {
+    M.Blocks++;
+    M.IRBytes += sizeof(BasicBlock);
+    for (BasicBlock::const_iterator I = B->begin(); I != B->end(); ++I) {
+      M.Instructions++;
+      M.IRBytes += sizeof(Instruction) + I->getNumOperands() * sizeof(Use);
+    }
+  }
+  return M;
+}
+
+MemoryStats Kaleidoscope::Memory() {
+  MemoryStats S;
+  S.ASTNodes = ASTNode::Live;
+  S.ASTBytes = ASTNode::Bytes;
+  S.Modules = Modules.size();
+  set<Module *>::iterator M;
+  for (M = Modules.begin(); M != Modules.end(); ++M)
+    for (Module::iterator F = (*M)->begin(); F != (*M)->end(); ++F) {
+      S.Functions++;
+      if (F->isDeclaration()) {
+        S.Declarations++;
+        S.Total.IRBytes += sizeof(Function) + F->arg_size() * sizeof(Argument);
+        continue;
+      }
+      S.PerFunction[F->getName().str()] += IRSize(F);
+    }
+  // tier-0 bodies kept aside for promoted functions
+  map<Function *, pair<uint64_t *, Function *> >::iterator T;
+  for (T = Tier1.begin(); T != Tier1.end(); ++T)
+    S.PerFunction[T->first->getName().str()] += IRSize(T->second.second);
+  Code->Collect(S.PerFunction);
+
+  map<string, FunctionMemory>::iterator P;
+  for (P = S.PerFunction.begin(); P != S.PerFunction.end(); ++P)
+    S.Total += P->second;
+  S.Runtime = GetRuntimeMemory();
+  return S;
+}
+
+/* vim: set sw=2 sts=2 : */
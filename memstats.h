@@ -0,0 +1,73 @@
+#ifndef _MEMSTATS_H_
+#define _MEMSTATS_H_
+
+#include <llvm/ExecutionEngine/JITEventListener.h>
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <utility>
+
+#include "library.h"
+
+// Memory held for one function name, every version of it (redefinitions,
+// tier-0 baselines) added up
+struct FunctionMemory {
+  unsigned Versions;          // IR definitions alive
+  unsigned long Blocks, Instructions;
+  size_t IRBytes;             // estimated, see MemoryStats
+  unsigned CodeVersions;      // machine code blobs alive
+  size_t CodeBytes;
+
+  FunctionMemory()
+      : Versions(0), Blocks(0), Instructions(0), IRBytes(0), CodeVersions(0),
+        CodeBytes(0) {}
+  FunctionMemory &operator+=(const FunctionMemory &o);
+};
+
+// Snapshot of what an engine holds (Kaleidoscope::Memory). IR bytes are an
+// estimate from object sizes, constants and types live in the LLVMContext
+// and aren't counted. AST nodes are leaked after codegen and counted for the
+// whole process, so is the runtime
+struct MemoryStats {
+  unsigned long ASTNodes;
+  size_t ASTBytes; // the nodes, not the strings and vectors they own
+
+  unsigned Modules;
+  unsigned long Functions, Declarations; // over every module
+  FunctionMemory Total;                  // IR and code of every function
+
+  RuntimeMemory Runtime;
+
+  std::map<std::string, FunctionMemory> PerFunction; // scoped names
+
+  MemoryStats();
+  // what's defined in a scope (see Kaleidoscope::Scope), e.g. to pick the
+  // server session to drop
+  FunctionMemory InScope(const std::string &scope) const;
+  size_t Bytes() const; // everything above
+
+  void PrintSummary(std::ostream &out) const;
+  void DumpJSON(std::ostream &out) const;
+};
+
+// Keeps the size of the machine code alive per function name. Kaleidoscope
+// registers one on its TheEE (see Kaleidoscope::Code)
+class CodeSizeListener : public llvm::JITEventListener {
+  std::map<void *, std::pair<std::string, size_t> > Live;
+
+public:
+  size_t Bytes; // of everything alive
+
+  CodeSizeListener() : Bytes(0) {}
+  void Collect(std::map<std::string, FunctionMemory> &per) const;
+
+  virtual void NotifyFunctionEmitted(const llvm::Function &F, void *Code,
+                                     size_t Size,
+                                     const EmittedFunctionDetails &Details);
+  virtual void NotifyFreeingMachineCode(void *OldPtr);
+};
+
+#endif // _MEMSTATS_H_
+
+/* vim: set sw=2 sts=2 : */
@@ -0,0 +1,145 @@
+#include <llvm/IR/Function.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "perfmap.h"
+
+using namespace std;
+using namespace llvm;
+
+PerfMapListener::PerfMapListener() {
+  ostringstream path;
+  path << "/tmp/perf-" << getpid() << ".map";
+  Out.open(path.str().c_str(), ios::trunc); // start from an empty map
+  Out << hex;
+}
+
+// perf map line: <start> <size> <symbol>, addresses and sizes in hex. Lines
+// are flushed right away, the process may be killed while being profiled
+void PerfMapListener::NotifyFunctionEmitted(
+    const Function &F, void *Code, size_t Size,
+    const EmittedFunctionDetails &Details) {
+  Out << (unsigned long)Code << " " << Size << " " << F.getName().str()
+      << endl;
+}
+
+// ----------------------------------------------------------------------
+// jitdump format, see tools/perf/Documentation/jitdump-specification.txt
+
+#if defined(__x86_64__)
+static const uint32_t ElfMach = EM_X86_64;
+#elif defined(__aarch64__)
+static const uint32_t ElfMach = EM_AARCH64;
+#else
+static const uint32_t ElfMach = EM_NONE;
+#endif
+
+struct JITDumpHeader {
+  uint32_t Magic, Version, TotalSize, ElfMach, Pad, Pid;
+  uint64_t Timestamp, Flags;
+};
+
+struct JITDumpRecord {
+  uint32_t Id, TotalSize;
+  uint64_t Timestamp;
+};
+
+struct JITDumpCodeLoad { // followed by the name and the code itself
+  JITDumpRecord Rec;
+  uint32_t Pid, Tid;
+  uint64_t Vma, CodeAddr, CodeSize, CodeIndex;
+};
+
+struct JITDumpDebugInfo { // followed by NrEntry entries
+  JITDumpRecord Rec;
+  uint64_t CodeAddr, NrEntry;
+};
+
+struct JITDumpDebugEntry { // followed by the file name
+  uint64_t Addr;
+  uint32_t Line, Discrim;
+};
+
+// perf orders jitdump records with the monotonic clock (perf record -k 1)
+static uint64_t Timestamp() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+JITDumpListener::JITDumpListener(const string &source)
+    : Source(source), Marker(NULL), CodeIndex(0) {
+  ostringstream path;
+  path << "/tmp/jit-" << getpid() << ".dump";
+  Fd = open(path.str().c_str(), O_CREAT | O_TRUNC | O_RDWR, 0666);
+  if (Fd < 0) {
+    cerr << "Can't create " << path.str() << endl;
+    return;
+  }
+  Marker = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC,
+                MAP_PRIVATE, Fd, 0);
+  JITDumpHeader H = { 0x4A695444, 1, sizeof(JITDumpHeader), ElfMach, 0,
+                      (uint32_t)getpid(), Timestamp(), 0 };
+  Write(&H, sizeof(H));
+}
+
+JITDumpListener::~JITDumpListener() {
+  if (Marker && Marker != MAP_FAILED)
+    munmap(Marker, sysconf(_SC_PAGESIZE));
+  if (Fd >= 0)
+    close(Fd);
+}
+
+void JITDumpListener::Write(const void *data, size_t size) {
+  if (Fd >= 0 && write(Fd, data, size) != (ssize_t)size)
+    cerr << "Short write to the jitdump" << endl;
+}
+
+void JITDumpListener::NotifyFunctionEmitted(
+    const Function &F, void *Code, size_t Size,
+    const EmittedFunctionDetails &Details) {
+  string Name = F.getName().str();
+  uint64_t Addr = (uintptr_t)Code;
+
+  // line table goes first so perf can attach it to the code load below
+  if (!Details.LineStarts.empty()) {
+    JITDumpDebugInfo D;
+    D.Rec.Id = 2; // JIT_CODE_DEBUG_INFO
+    D.Rec.Timestamp = Timestamp();
+    D.Rec.TotalSize = sizeof(D) + Details.LineStarts.size() *
+                                      (sizeof(JITDumpDebugEntry) +
+                                       Source.size() + 1);
+    D.CodeAddr = Addr;
+    D.NrEntry = Details.LineStarts.size();
+    Write(&D, sizeof(D));
+    for (size_t i = 0; i < Details.LineStarts.size(); i++) {
+      JITDumpDebugEntry E = { Details.LineStarts[i].Address,
+                              Details.LineStarts[i].Loc.getLine(), 0 };
+      Write(&E, sizeof(E));
+      Write(Source.c_str(), Source.size() + 1);
+    }
+  }
+
+  JITDumpCodeLoad L;
+  L.Rec.Id = 0; // JIT_CODE_LOAD
+  L.Rec.Timestamp = Timestamp();
+  L.Rec.TotalSize = sizeof(L) + Name.size() + 1 + Size;
+  L.Pid = getpid();
+  L.Tid = syscall(SYS_gettid);
+  L.Vma = L.CodeAddr = Addr;
+  L.CodeSize = Size;
+  L.CodeIndex = CodeIndex++;
+  Write(&L, sizeof(L));
+  Write(Name.c_str(), Name.size() + 1);
+  Write(Code, Size);
+}
+
+/* vim: set sw=2 sts=2 : */
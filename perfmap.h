@@ -0,0 +1,50 @@
+#ifndef _PERFMAP_H_
+#define _PERFMAP_H_
+
+#include <llvm/ExecutionEngine/JITEventListener.h>
+
+#include <fstream>
+#include <string>
+
+// Writes every JIT'd function to /tmp/perf-<pid>.map so perf can symbolize
+// samples landing in JIT'd code. Register it with
+//   TheEE->RegisterJITEventListener(new PerfMapListener());
+// The map is append-only: perf resolves symbols after the run, so freed code
+// (e.g. top-level expressions) keeps its entry for the samples taken while
+// it was live, and code reusing its address is a later entry, which wins.
+class PerfMapListener : public llvm::JITEventListener {
+  std::ofstream Out;
+
+public:
+  PerfMapListener();
+
+  virtual void NotifyFunctionEmitted(const llvm::Function &F, void *Code,
+                                     size_t Size,
+                                     const EmittedFunctionDetails &Details);
+};
+
+// Writes a perf jitdump (/tmp/jit-<pid>.dump) with the code and the line
+// table of every JIT'd function, compile with debug info on
+// (Kaleidoscope::EnableDebugInfo) to get line tables. Use with
+//   perf record -k 1 ...; perf inject --jit -i perf.data -o perf.jit.data
+// so perf annotate can attribute samples to lines of Source.
+class JITDumpListener : public llvm::JITEventListener {
+  std::string Source;
+  int Fd;
+  void *Marker; // perf finds the dump through this mapping
+  unsigned long CodeIndex;
+
+  void Write(const void *data, size_t size);
+
+public:
+  JITDumpListener(const std::string &source);
+  ~JITDumpListener();
+
+  virtual void NotifyFunctionEmitted(const llvm::Function &F, void *Code,
+                                     size_t Size,
+                                     const EmittedFunctionDetails &Details);
+};
+
+#endif // _PERFMAP_H_
+
+/* vim: set sw=2 sts=2 : */
@@ -0,0 +1,169 @@
+// Compile/evaluate server over a Unix domain socket, one thread per client.
+// Requests are single lines holding any number of top-level items, items
+// run in order and the reply is a single line too:
+//   ok <value of each top-level expression ...>
+//   error <line>:<col>: <message of the first failing item>
+// Every client gets its own scope (see Kaleidoscope::Scope), dropped when it
+// disconnects. The library given with -lib is compiled once into the global
+// scope and shared. Compilation is serialized, evaluation runs concurrently.
+// Operators a client defines are its own too, precedence included.
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include "ast.h"
+#include "library.h"
+
+using namespace std;
+
+static Kaleidoscope *K;
+static mutex CompileLock; // guards K, LLVM and the parser
+
+// Errors are reported on ErrorStream by codegen, capture this thread's for
+// the reply (cerr is left alone, library output may be going there)
+class CaptureErrors {
+  ostream *Saved;
+
+public:
+  ostringstream Text;
+  CaptureErrors() : Saved(ErrorStream) { ErrorStream = &Text; }
+  ~CaptureErrors() { ErrorStream = Saved; }
+};
+
+static string Evaluate(const string &Scope, const string &Request) {
+  istringstream in(Request);
+  Lexer lexer(in);
+  ostringstream reply;
+  reply.precision(17);
+  reply << "ok";
+
+  unique_lock<mutex> L(CompileLock);
+  lexer.Next(); // bootstrap the lexer
+  while (lexer.Current().lex_comp != Token::tokEOF) {
+    K->Scope = Scope;
+    K->StartModule();
+    pair<bool, llvm::Function *> R;
+    {
+      CaptureErrors E;
+      R = ParseNext(lexer, *K);
+      if (!R.first) {
+        string msg = E.Text.str();
+        msg = msg.substr(0, msg.find('\n')); // the first one
+        K->Scope.clear();
+        return "error " + (msg.empty() ? string("parse error") : msg);
+      }
+    }
+    K->Scope.clear();
+    if (R.second == NULL)
+      continue;
+    // callees are compiled right away (no lazy stubs), so nothing touches
+    // LLVM once the lock is released
+    double (*FP)() = (double (*)())K->TheEE->getPointerToFunction(R.second);
+    L.unlock();
+    reply << " " << FP();
+    L.lock();
+    K->Release(R.second);
+  }
+  return reply.str();
+}
+
+static bool WriteAll(int fd, const string &data) {
+  for (size_t done = 0; done < data.size();) {
+    ssize_t n = write(fd, data.data() + done, data.size() - done);
+    if (n <= 0)
+      return false;
+    done += n;
+  }
+  return true;
+}
+
+static void Serve(int fd, unsigned Session) {
+  char scope[32];
+  snprintf(scope, sizeof(scope), "s%u.", Session); // '.' can't be in ids
+  SetArrayOwner(Session); // freed with the session
+  string pending;
+  char buf[4096];
+  ssize_t n;
+  bool open = true;
+  while (open && (n = read(fd, buf, sizeof(buf))) > 0) {
+    pending.append(buf, n);
+    size_t eol;
+    while (open && (eol = pending.find('\n')) != string::npos) {
+      string reply = Evaluate(scope, pending.substr(0, eol)) + "\n";
+      pending.erase(0, eol + 1);
+      open = WriteAll(fd, reply);
+    }
+  }
+  close(fd);
+  flushd();
+  lock_guard<mutex> G(CompileLock);
+  K->DropScope(scope);
+  ReleaseArrays(Session); // nothing compiled in the scope is left to use them
+}
+
+// compile (and run top-level expressions of) the shared library
+static bool LoadLibrary(const char *path) {
+  ifstream in(path);
+  if (!in) {
+    cerr << "Can't read " << path << endl;
+    return false;
+  }
+  Lexer lexer(in);
+  lexer.Next(); // bootstrap the lexer
+  while (lexer.Current().lex_comp != Token::tokEOF)
+    if (double(*FP)() = K->Parse(lexer))
+      FP();
+  flushd();
+  return true;
+}
+
+// usage: server [-socket=path] [-lib=file]
+int main(int argc, char **argv) {
+  const char *Socket = "/tmp/kaleidoscope.sock", *Library = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "-socket=", 8) == 0)
+      Socket = argv[i] + 8;
+    else if (strncmp(argv[i], "-lib=", 5) == 0)
+      Library = argv[i] + 5;
+    else {
+      cerr << "usage: " << argv[0] << " [-socket=path] [-lib=file]" << endl;
+      return 1;
+    }
+  }
+
+  K = new Kaleidoscope();
+  K->TheEE->DisableLazyCompilation(true);
+  ShareOutput();
+  if (Library && !LoadLibrary(Library))
+    return 1;
+
+  signal(SIGPIPE, SIG_IGN); // clients hanging up are seen by write()
+  int srv = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, Socket, sizeof(addr.sun_path) - 1);
+  unlink(Socket);
+  if (srv < 0 || bind(srv, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(srv, 128) < 0) {
+    perror(Socket);
+    return 1;
+  }
+
+  for (unsigned Session = 1;; Session++) {
+    int fd = accept(srv, NULL, NULL);
+    if (fd < 0)
+      continue;
+    thread(Serve, fd, Session).detach();
+  }
+  return 0;
+}
+
+/* vim: set sw=2 sts=2 : */
@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <iomanip>
+#include "stats.h"
+
+using namespace std;
+
+static const char *PhaseNames[] = { "lex", "parse", "codegen", "optimize",
+                                    "jit" };
+
+CompileStats::CompileStats()
+    : Current(phIdle), Since(chrono::steady_clock::now()), LexSeconds(0),
+      LexAtBegin(0) {}
+
+void CompileStats::BeginItem(Lexer &lexer) {
+  Switch(phIdle);
+  Item I;
+  I.Kind = "";
+  I.Name = "";
+  fill(I.Seconds, I.Seconds + phIdle, 0.0);
+  I.InstsBefore = I.InstsAfter = 0;
+  Items.push_back(I);
+  lexer.Timer = &LexSeconds;
+  LexAtBegin = LexSeconds;
+  Switch(phParse);
+}
+
+void CompileStats::EndItem(const string &kind) {
+  Switch(phIdle);
+  Item &I = Items.back();
+  I.Kind = kind;
+  // lexing is interleaved with parsing, take it out of the parse time
+  I.Seconds[phLex] = LexSeconds - LexAtBegin;
+  I.Seconds[phParse] = max(0.0, I.Seconds[phParse] - I.Seconds[phLex]);
+}
+
+CompileStats::phase CompileStats::Switch(phase p) {
+  chrono::steady_clock::time_point now = chrono::steady_clock::now();
+  if (Current != phIdle && !Items.empty())
+    Items.back().Seconds[Current] += chrono::duration<double>(now - Since)
+                                         .count();
+  Since = now;
+  phase prev = Current;
+  Current = p;
+  return prev;
+}
+
+void CompileStats::PrintSummary(ostream &out) const {
+  double total[phIdle] = { 0 };
+  unsigned long before = 0, after = 0;
+  vector<pair<double, size_t> > slowest;
+  for (size_t i = 0; i < Items.size(); i++) {
+    double t = 0;
+    for (int p = 0; p < phIdle; p++) {
+      total[p] += Items[i].Seconds[p];
+      t += Items[i].Seconds[p];
+    }
+    before += Items[i].InstsBefore;
+    after += Items[i].InstsAfter;
+    slowest.push_back(make_pair(t, i));
+  }
+  sort(slowest.rbegin(), slowest.rend());
+
+  out << "Compiled " << Items.size() << " top-level items" << endl;
+  for (int p = 0; p < phIdle; p++)
+    out << "  " << left << setw(10) << PhaseNames[p] << right << fixed
+        << setprecision(3) << setw(10) << total[p] * 1e3 << " ms" << endl;
+  out << "  IR instructions " << before << " -> " << after
+      << " after optimization" << endl;
+  out << "Slowest items:" << endl;
+  for (size_t i = 0; i < slowest.size() && i < 10; i++) {
+    const Item &I = Items[slowest[i].second];
+    out << "  " << setw(10) << slowest[i].first * 1e3 << " ms  " << I.Kind
+        << " " << I.Name << endl;
+  }
+}
+
+void CompileStats::DumpJSON(ostream &out) const {
+  out << "{\"items\": [";
+  for (size_t i = 0; i < Items.size(); i++) {
+    const Item &I = Items[i];
+    out << (i ? ",\n  " : "\n  ") << "{\"kind\": \"" << I.Kind
+        << "\", \"name\": \"" << I.Name << "\"";
+    for (int p = 0; p < phIdle; p++)
+      out << ", \"" << PhaseNames[p] << "\": " << I.Seconds[p];
+    out << ", \"insts_before\": " << I.InstsBefore
+        << ", \"insts_after\": " << I.InstsAfter << "}";
+  }
+  out << "\n]}" << endl;
+}
+
+/* vim: set sw=2 sts=2 : */
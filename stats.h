@@ -0,0 +1,53 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "lexer.h"
+
+// Wall time per compilation phase and IR size for every top-level item.
+// Kaleidoscope::Stats is NULL unless enabled, so there's nothing to pay for
+// it otherwise. Time is charged to the current phase until the next Switch.
+class CompileStats {
+public:
+  typedef enum phase {
+    phLex = 0,
+    phParse,
+    phCodegen,
+    phOptimize,
+    phJIT,
+    phIdle, // between items, not recorded
+  } phase;
+
+  struct Item {
+    std::string Kind; // def, extern or expr
+    std::string Name;
+    double Seconds[phIdle];
+    unsigned InstsBefore, InstsAfter; // IR instructions around TheFPM->run
+  };
+
+private:
+  std::vector<Item> Items;
+  phase Current;
+  std::chrono::steady_clock::time_point Since;
+  double LexSeconds, LexAtBegin; // the lexer accumulates into LexSeconds
+
+public:
+  CompileStats();
+
+  void BeginItem(Lexer &lexer); // start charging a new item (to phParse)
+  void EndItem(const std::string &kind); // parse/codegen done, back to idle
+  phase Switch(phase p);                 // returns the previous phase
+  Item &Last() { return Items.back(); }
+  bool Empty() const { return Items.empty(); }
+
+  void PrintSummary(std::ostream &out) const;
+  void DumpJSON(std::ostream &out) const;
+};
+
+#endif // _STATS_H_
+
+/* vim: set sw=2 sts=2 : */
@@ -8,7 +8,8 @@ int main() {
 
   Token t;
   while ((t = l.Next()).lex_comp != Token::tokEOF)
-    cerr << "Lexed: " << t.lexem << " as " << t.lex_comp << endl;
+    cerr << "Lexed: " << t.lexem << " as " << t.lex_comp << " at " << t.loc.Line
+         << ":" << t.loc.Col << endl;
 
   return 0;
 }
@@ -1,19 +1,116 @@
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include "ast.h"
+#include "library.h"
+#include "perfmap.h"
 
 using namespace std;
 
-int main() {
+// usage: test_parser [-stats] [-stats-json=file] [-perf-map] [-g=source]
+//                    [-counters[=file]] [-tiering[=calls]]
+//                    [-batch=N] [-batch-window=ms] [-memory[=file]] [-ssa]
+// -g names the source fed through stdin for line tables, written to a perf
+// jitdump (no debugger support, the JIT emits no DWARF)
+// -counters instruments the code, counters are dumped at exit (stderr)
+// -tiering recompiles definitions called that many times (1000)
+// -batch JITs up to N consecutive top-level expressions together, or as
+// many as came within -batch-window milliseconds
+// -memory reports what the engine holds at exit, as JSON when given a file
+// -ssa builds SSA in codegen instead of stack slots for mem2reg to promote
+int main(int argc, char **argv) {
+  bool PrintStats = false, PerfMap = false, DirectSSA = false;
+  unsigned Tiering = 0, Batch = 1;
+  double BatchWindow = 0;
+  const char *StatsJSON = NULL, *DebugSource = NULL, *Counters = NULL;
+  const char *Memory = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-stats") == 0)
+      PrintStats = true;
+    else if (strncmp(argv[i], "-stats-json=", 12) == 0)
+      StatsJSON = argv[i] + 12;
+    else if (strcmp(argv[i], "-perf-map") == 0)
+      PerfMap = true;
+    else if (strncmp(argv[i], "-g=", 3) == 0)
+      DebugSource = argv[i] + 3;
+    else if (strcmp(argv[i], "-counters") == 0)
+      Counters = "-";
+    else if (strncmp(argv[i], "-counters=", 10) == 0)
+      Counters = argv[i] + 10;
+    else if (strcmp(argv[i], "-tiering") == 0)
+      Tiering = 1000;
+    else if (strncmp(argv[i], "-tiering=", 9) == 0)
+      Tiering = atoi(argv[i] + 9);
+    else if (strncmp(argv[i], "-batch=", 7) == 0)
+      Batch = atoi(argv[i] + 7);
+    else if (strncmp(argv[i], "-batch-window=", 14) == 0)
+      BatchWindow = atof(argv[i] + 14) / 1000;
+    else if (strcmp(argv[i], "-memory") == 0)
+      Memory = "-";
+    else if (strncmp(argv[i], "-memory=", 8) == 0)
+      Memory = argv[i] + 8;
+    else if (strcmp(argv[i], "-ssa") == 0)
+      DirectSSA = true;
+    else {
+      cerr << "usage: " << argv[0]
+           << " [-stats] [-stats-json=file] [-perf-map] [-g=source]"
+              " [-counters[=file]] [-tiering[=calls]] [-batch=N]"
+              " [-batch-window=ms] [-memory[=file]] [-ssa]" << endl;
+      return 1;
+    }
+  }
+
   Lexer lexer(cin);
   Kaleidoscope K;
+  if (PrintStats || StatsJSON)
+    K.Stats = new CompileStats();
+  if (PerfMap)
+    K.TheEE->RegisterJITEventListener(new PerfMapListener());
+  if (DirectSSA)
+    K.EnableDirectSSA();
+  if (Tiering)
+    K.EnableTiering(Tiering);
+  if (Counters) {
+    K.Instrument = true;
+    DumpCountersAtExit(Counters);
+  }
+  if (DebugSource) {
+    K.EnableDebugInfo(DebugSource);
+    K.TheEE->RegisterJITEventListener(new JITDumpListener(DebugSource));
+  }
+
+  K.BatchSize = Batch;
+  K.BatchWindow = BatchWindow;
 
   lexer.Next(); // bootstrap the lexer
   while (lexer.Current().lex_comp != Token::tokEOF) {
-    if (double(*FP)() = K.Parse(lexer)) {
-      cout << ">> " << FP() << endl;
+    if (Batch > 1) {
+      vector<double> R;
+      K.ParseBatch(lexer, R);
+      flushd(); // keep program output ahead of the results
+      for (unsigned i = 0; i < R.size(); i++)
+        cout << ">> " << R[i] << endl;
+    } else if (double(*FP)() = K.Parse(lexer)) {
+      double R = FP();
+      flushd(); // keep program output ahead of the result
+      cout << ">> " << R << endl;
     }
   }
 
+  if (PrintStats)
+    K.Stats->PrintSummary(cerr);
+  if (StatsJSON) {
+    ofstream out(StatsJSON);
+    K.Stats->DumpJSON(out);
+  }
+  if (Memory && strcmp(Memory, "-") == 0)
+    K.Memory().PrintSummary(cerr);
+  else if (Memory) {
+    ofstream out(Memory);
+    K.Memory().DumpJSON(out);
+  }
+
   return 0;
 }
 